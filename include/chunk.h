@@ -20,7 +20,7 @@
 
 #define WRITE_OPERATION(chunk, variable, operation)                            \
   do {                                                                         \
-    if (variable > 256u) {                                                     \
+    if (variable > UINT8_MAX) {                                                \
       writeChunk(chunk, operation + 1, parser.previous.line);                  \
       WRITE_LONG_CHUNK(chunk, variable, parser.previous.line);                 \
     } else {                                                                   \
@@ -90,8 +90,48 @@ typedef enum {
   OP_JUMP,
   OP_JUMP_IF_FALSE,
   OP_RETURN,
+  // superinstructions, fused by the compiler from the most frequent
+  // sequences in test/benchmark, or by the peephole pass. all of them take
+  // one byte operands, or a jump offset.
+  OP_GET_LOCAL_PROPERTY, // OP_GET_LOCAL, OP_GET_PROPERTY
+  OP_SET_LOCAL_POP,      // OP_SET_LOCAL, OP_POP
+  OP_SET_GLOBAL_POP,     // OP_SET_GLOBAL, OP_POP
+  OP_POP_JUMP_IF_FALSE,  // OP_JUMP_IF_FALSE, OP_POP on both branches
+  OP_POP_JUMP_IF_TRUE,   // OP_NOT, OP_POP_JUMP_IF_FALSE
+  // quickened variants of OP_ADD, never emitted by the compiler. the
+  // interpreter rewrites OP_ADD into one of these once it has seen its
+  // operand types, and back again when they stop matching. all three keep
+  // the count of those deopts as their operand.
+  OP_ADD_NUM,
+  OP_ADD_STR,
 } OpCode;
 
+// polymorphic sites remember up to this many layouts before giving up
+#define CACHE_ENTRIES 4
+
+typedef struct {
+  // layout of the receiver, entries are compared by identity
+  struct ObjShape *shape;
+  // for property sets that add a field, the layout after adding it
+  struct ObjShape *transition;
+  // resolved method for invokes, super calls and bound method reads
+  struct ObjClosure *method;
+  uint32_t slot;
+} CacheEntry;
+
+// inline cache of one property, invoke or super instruction. the
+// instruction operand is the index of its cache instead of the name constant.
+typedef struct {
+  ObjString *name;
+  // value of vm.methodEpoch when the entries were recorded
+  uint32_t epoch;
+  uint8_t count;
+  bool megamorphic;
+  uint64_t hits;
+  uint64_t misses;
+  CacheEntry entries[CACHE_ENTRIES];
+} InlineCache;
+
 typedef struct {
   // same as a byte
   uint8_t *code;
@@ -99,14 +139,39 @@ typedef struct {
   uint32_t capacity;
   LineArray lines;
   ValueArray constants;
+  InlineCache *caches;
+  uint32_t cacheCount;
+  uint32_t cacheCapacity;
+  // open addressed set of the number and string constants, as their
+  // index + 1 (0 is an empty entry), so makeConstant can reuse them. only
+  // kept while the chunk is compiled.
+  uint32_t *constantIndex;
+  uint32_t constantIndexCount;
+  uint32_t constantIndexCapacity;
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
 void freeChunk(Chunk *chunk);
-// make constant saves a variable to the chunk
+// drops the code from offset on, for the compiler to replace it
+void truncateChunk(Chunk *chunk, uint32_t offset);
+// make constant saves a variable to the chunk. numbers with the same bits
+// and the same (interned) string share one slot.
 uint32_t makeConstant(Chunk *chunk, Value value);
+// drops the index makeConstant looks constants up in, once the chunk is
+// compiled. strings are found by address and may be moved after that.
+void freeConstantIndex(Chunk *chunk);
 // write constant writes a constant to the chunk alongside OP_CONSTANT
 void writeConstant(Chunk *chunk, OpCode code, Value value, int line);
+// make cache adds an empty inline cache for a property of the given name,
+// the name must already be reachable (e.g. in the constant table)
+uint32_t makeCache(Chunk *chunk, ObjString *name);
+// the one or three byte operand of the instruction at offset
+uint32_t readOperand(Chunk *chunk, uint32_t offset, bool isLong);
+// bytes taken by the instruction at offset, operands included
+int instructionLength(Chunk *chunk, uint32_t offset);
+// the most stack slots a call of the chunk holds at once, starting with
+// the given slots for the callee and its arguments
+int maxStackSlots(Chunk *chunk, int slots);
 
 #endif
@@ -10,6 +10,11 @@
 // #define DEBUG_PRINT_CODE
 // #define DEBUG_TRACE_EXECUTION
 
+// threaded dispatch relies on the labels-as-values extension of GCC/Clang
+#if defined(__GNUC__) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
 
@@ -6,5 +6,6 @@
 
 void disassembleChunk(Chunk *chunk, const char *name);
 int disassembleInstruction(Chunk *chunk, int offset);
+void printCacheStats(Chunk *chunk, const char *name);
 
 #endif
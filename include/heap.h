@@ -0,0 +1,142 @@
+#ifndef clox_heap_h
+#define clox_heap_h
+
+#include "common.h"
+
+// objects up to HEAP_MAX_CELL bytes are cells of a size class, rounded up
+// to HEAP_GRANULE. bigger ones are the large objects and come from malloc.
+#define HEAP_GRANULE 16
+#define HEAP_MAX_CELL 256
+#define HEAP_CLASS_COUNT (HEAP_MAX_CELL / HEAP_GRANULE)
+// cells are carved from arenas of this size, aligned to it
+#define HEAP_ARENA_SIZE (256 * 1024)
+#define HEAP_BITMAP_WORDS (HEAP_ARENA_SIZE / HEAP_GRANULE / 64)
+
+// the state of the cells of an arena lives in bitmaps at its start, with
+// one bit per granule set for the first granule of each cell. marking
+// writes none of the objects, and a cell is free when neither its old nor
+// its young bit is set.
+typedef struct Arena {
+  struct Arena *next;
+  // next arena with young cells
+  struct Arena *nextYoung;
+  int sizeClass;
+  bool hasYoung;
+  // the cells are being moved out, see heapEvacuate
+  bool evacuating;
+  // cells that survived a collection
+  uint64_t old[HEAP_BITMAP_WORDS];
+  // cells allocated since the last collection
+  uint64_t young[HEAP_BITMAP_WORDS];
+  uint64_t marked[HEAP_BITMAP_WORDS];
+} Arena;
+
+// comes right before a large object, which is in the young or old list
+typedef struct LargeObject {
+  struct LargeObject *prev;
+  struct LargeObject *next;
+  size_t size;
+  bool isMarked;
+  bool isYoung;
+} LargeObject;
+
+typedef struct Cell {
+  struct Cell *next;
+} Cell;
+
+// free cells of every size class
+typedef struct {
+  Cell *heads[HEAP_CLASS_COUNT];
+  Cell *tails[HEAP_CLASS_COUNT];
+} FreeLists;
+
+typedef void (*HeapVisitor)(void *object);
+// told about every object heapEvacuate moves, before anything else is
+typedef void (*HeapMover)(void *from, void *to);
+
+// set while other threads mark or sweep, the bitmaps are then updated
+// with atomic operations
+extern int heapSharing;
+
+static inline Arena *arenaOf(void *cell) {
+  return (Arena *)((uintptr_t)cell & ~(uintptr_t)(HEAP_ARENA_SIZE - 1));
+}
+
+static inline size_t granuleOf(void *cell) {
+  return ((uintptr_t)cell & (HEAP_ARENA_SIZE - 1)) / HEAP_GRANULE;
+}
+
+static inline bool heapIsMarked(void *object, bool large) {
+  if (large) {
+    return ((LargeObject *)object - 1)->isMarked;
+  }
+  size_t granule = granuleOf(object);
+  return (arenaOf(object)->marked[granule / 64] >> (granule % 64)) & 1;
+}
+
+// marks an object, returns false if it already was
+static inline bool heapMark(void *object, bool large) {
+  if (large) {
+    LargeObject *header = (LargeObject *)object - 1;
+    if (__atomic_load_n(&heapSharing, __ATOMIC_RELAXED)) {
+      return !__atomic_exchange_n(&header->isMarked, true, __ATOMIC_ACQ_REL);
+    }
+    bool wasMarked = header->isMarked;
+    header->isMarked = true;
+    return !wasMarked;
+  }
+
+  size_t granule = granuleOf(object);
+  uint64_t *word = &arenaOf(object)->marked[granule / 64];
+  uint64_t bit = (uint64_t)1 << (granule % 64);
+  if (__atomic_load_n(&heapSharing, __ATOMIC_RELAXED)) {
+    return !(__atomic_fetch_or(word, bit, __ATOMIC_ACQ_REL) & bit);
+  }
+  bool wasMarked = *word & bit;
+  *word |= bit;
+  return !wasMarked;
+}
+
+// where an object was moved to by the last heapEvacuate, the object itself
+// if it did not move. an evacuated cell keeps its header, and the new
+// address right after it.
+static inline void *heapForward(void *object, bool large) {
+  if (large || !arenaOf(object)->evacuating) {
+    return object;
+  }
+  return ((void **)object)[1];
+}
+
+void initFreeLists(FreeLists *lists);
+void *heapAllocate(size_t size);
+void heapFree(void *object, size_t size);
+// frees into lists that belong to another thread, to be reclaimed later
+void heapFreeTo(FreeLists *lists, void *object, size_t size);
+// hands the cells freed into lists back to the heap, in constant time
+void heapReclaim(FreeLists *lists);
+
+// unmarks every object, when a full collection starts
+void heapClearMarks();
+// frees the unmarked young objects, the marked ones become old
+void heapSweepYoung(HeapVisitor release);
+// makes every young object old, the unmarked ones are left for heapSweep
+void heapPromoteYoung();
+void heapStartSweep();
+// frees the unmarked old objects, stopping at the end of an arena once
+// budget of them are freed. returns true when there are none left.
+bool heapSweep(int budget, HeapVisitor release);
+void heapEachObject(HeapVisitor visit);
+// picks the arenas to move the objects out of: the ones at most a quarter
+// full, other than those being allocated from, or all of them. returns
+// false when there are too few sparse ones to be worth it.
+bool heapPlanCompaction(bool everything);
+// moves the objects out of the chosen arenas into the others, leaving a
+// forwarding address in each. the chosen arenas stay mapped, but are no
+// longer part of the heap.
+void heapEvacuate(HeapMover moved);
+// unmaps the evacuated arenas once no reference to them is left, returns
+// how many there were
+int heapReleaseEvacuated();
+void freeHeap();
+
+#endif
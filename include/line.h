@@ -18,5 +18,7 @@ void initLineArray(LineArray *lineArray);
 void writeLineArray(LineArray *lineArray, int line);
 void freeLineArray(LineArray *lineArray);
 int getLine(LineArray *lineArray, int offset);
+// forgets the lines of the last count bytes
+void truncateLineArray(LineArray *lineArray, int count);
 
 #endif
\ No newline at end of file
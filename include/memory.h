@@ -2,13 +2,18 @@
 #define clox_memory_h
 
 #include "common.h"
+#include "heap.h"
+#include "object.h"
 #include "value.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count)                                                  \
   (type *)reallocate(NULL, 0, sizeof(type) * (count), true)
 
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0, true)
 
+#define FREE_OBJ(type, pointer) freeHeapObject(pointer, sizeof(type))
+
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity) * 2)
 
 #define GROW_ARRAY_NO_GC(type, pointer, oldCount, newCount)                    \
@@ -23,10 +28,38 @@
   reallocate(pointer, sizeof(type) * (oldCount), 0, false)
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize, bool triggerGC);
+// objects come from the size classes of the heap instead of realloc
+void *allocateHeapObject(size_t size);
+void freeHeapObject(void *object, size_t size);
 
 void freeObjects();
 void collectGarbage();
+// waits for the sweeping of the last full collection to end
+void finishSweeping();
+// finishes sweeping and adds the last full collection to vm.gcStats
+void flushGCStats();
+// monotonic time in ns
+uint64_t gcClock();
+// moves objects out of sparse arenas, only safe between instructions
+void compactHeap();
 void markValue(Value value);
 void markObject(Obj *object);
+void rememberObject(Obj *object);
+
+static inline bool isMarked(Obj *object) {
+  return heapIsMarked(object, object->flags & OBJ_LARGE);
+}
+
+// has to follow every store of a reference into an object that may already
+// be marked, with no allocation in between. outside of a full collection
+// only old objects are marked, and minor collections trace the remembered
+// ones again to find the young objects they point to. while a full
+// collection is marking, the remembered objects are traced again before it
+// finishes, so references stored into objects it already traced are found.
+static inline void writeBarrier(Obj *object) {
+  if (!(object->flags & OBJ_REMEMBERED) && isMarked(object)) {
+    rememberObject(object);
+  }
+}
 
 #endif
@@ -8,6 +8,9 @@
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
+// a string value, flat or still a rope
+#define IS_ANY_STRING(value) (IS_STRING(value) || IS_ROPE(value))
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
 #define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
@@ -23,6 +26,19 @@
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
 #define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
+#define AS_SHAPE(value) ((ObjShape *)AS_OBJ(value))
+#define AS_ROPE(value) ((ObjRope *)AS_OBJ(value))
+
+// instances fall back to a hash table once they have more fields than this
+#define SHAPE_MAX_FIELDS 32
+// shapes with more fields than this also keep a name -> slot table
+#define SHAPE_LINEAR_FIELDS 8
+
+// concatenations shorter than this are copied right away
+#define ROPE_MIN_LENGTH 32
+// ropes nest at most this many right pieces deep, which bounds the stack
+// that flattening them takes
+#define ROPE_MAX_DEPTH 64
 
 typedef enum {
   OBJ_BOUND_METHOD,
@@ -31,27 +47,40 @@ typedef enum {
   OBJ_FUNCTION,
   OBJ_INSTANCE,
   OBJ_NATIVE,
+  OBJ_ROPE,
+  OBJ_SHAPE,
   OBJ_STRING,
   OBJ_UPVALUE,
 } ObjType;
 
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
+
+// the object is a large object, outside the arenas
+#define OBJ_LARGE 0x1
+// the object is in the remembered set
+#define OBJ_REMEMBERED 0x2
+
+// the mark bits and the list of objects are kept by the heap, the header
+// only holds what the object itself needs
 struct Obj {
-  ObjType type;
-  bool isMarked;
-  struct Obj *next;
+  uint8_t type;
+  uint8_t flags;
 };
 
 typedef struct {
   Obj obj;
   int arity;
   int upvalueCount;
+  // stack slots a call holds at most, the callee and arguments included
+  int maxSlots;
   Chunk chunk;
   ObjString *name;
 } ObjFunction;
 
 typedef struct ObjUpvalue {
   Obj obj;
-  int location;
+  // points into the stack while open, and to closed once it is closed
+  Value *location;
   Value closed;
   struct ObjUpvalue *next;
 } ObjUpvalue;
@@ -63,23 +92,46 @@ typedef struct {
   NativeFn function;
 } ObjNative;
 
-typedef struct {
+typedef struct ObjClosure {
   Obj obj;
   ObjFunction *function;
   ObjUpvalue **upvalues;
   int upvalueCount;
 } ObjClosure;
 
+// a shape describes the layout of an instance: field names[i] lives
+// in slot i. shapes of a class form a tree rooted at the empty shape,
+// adding a field moves an instance to the child shape for that name.
+typedef struct ObjShape {
+  Obj obj;
+  int fieldCount;
+  ObjString **names;
+  Table slots;
+  Table transitions;
+} ObjShape;
+
 typedef struct {
   Obj obj;
   ObjString *name;
   Table methods;
+  ObjShape *rootShape;
+  // inline slots for new instances, the most fields seen in one instance
+  int instanceFields;
+  // set once a call site caches one of its methods
+  bool hasCachedMethods;
 } ObjClass;
 
 typedef struct {
   Obj obj;
   ObjClass *klass;
-  Table fields;
+  // NULL once the instance has switched to dictionary mode
+  ObjShape *shape;
+  // points to inlineFields until it needs more than inlineCount slots
+  Value *fields;
+  int fieldCapacity;
+  int inlineCount;
+  Table dictionary;
+  Value inlineFields[];
 } ObjInstance;
 
 typedef struct {
@@ -95,19 +147,71 @@ struct ObjString {
   char chars[];
 };
 
+// the concatenation of two strings or ropes, left and right. the
+// characters are only copied when something needs them, flat then keeps
+// the whole string and the pieces are let go
+typedef struct {
+  Obj obj;
+  int length;
+  // how many right pieces are nested in each other, 0 once it is flat
+  int depth;
+  Obj *left;
+  Obj *right;
+  ObjString *flat;
+} ObjRope;
+
 ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method);
 ObjClass *newClass(ObjString *name);
 ObjClosure *newClosure(ObjFunction *function);
 ObjFunction *newFunction();
 ObjInstance *newInstance(ObjClass *klass);
 ObjNative *newNative(NativeFn function);
-ObjUpvalue *newUpvalue(int pos);
+ObjUpvalue *newUpvalue(Value *slot);
+ObjShape *newShape(ObjShape *parent, ObjString *name);
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name);
+void instanceSetField(ObjInstance *instance, ObjString *name, Value value);
 ObjString *copyString(const char *chars, int length);
-ObjString *createString(int length);
+Obj *concatenateStrings(Obj *left, Obj *right);
+ObjString *flattenRope(ObjRope *rope);
+bool ropesEqual(Value a, Value b);
 void printObject(Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+// the characters of a string value, a rope is flattened first
+static inline ObjString *asFlatString(Value value) {
+  if (IS_ROPE(value)) {
+    return flattenRope(AS_ROPE(value));
+  }
+  return AS_STRING(value);
+}
+
+static inline int shapeFindSlot(ObjShape *shape, ObjString *name) {
+  if (shape->fieldCount > SHAPE_LINEAR_FIELDS) {
+    Value slot;
+    return tableGet(&shape->slots, name, &slot) ? (int)AS_IDX(slot) : -1;
+  }
+  for (int i = shape->fieldCount - 1; i >= 0; i--) {
+    if (shape->names[i] == name) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static inline bool instanceGetField(ObjInstance *instance, ObjString *name,
+                                    Value *value) {
+  if (instance->shape == NULL) {
+    return tableGet(&instance->dictionary, name, value);
+  }
+  int slot = shapeFindSlot(instance->shape, name);
+  if (slot == -1) {
+    return false;
+  }
+  *value = instance->fields[slot];
+  return true;
+}
+
 #endif
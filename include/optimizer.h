@@ -0,0 +1,12 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+// peephole pass over the finished code of a function. jumps are threaded,
+// short sequences replaced by shorter ones and unreachable code dropped,
+// then the jump offsets and lines are rebuilt. the chunk is left as it
+// was if a jump would no longer fit in its operand.
+void optimizeChunk(Chunk *chunk);
+
+#endif
@@ -4,17 +4,33 @@
 #include "common.h"
 #include "value.h"
 
+// the stack is allocated once and never moves,
+// so frames and open upvalues can point straight into it
 typedef struct {
   Value *items;
-  int top;
-  int capacity;
+  Value *top;
+  Value *end;
+  // whole mapping, including the guard page
+  void *mapping;
+  size_t mappingSize;
 } Stack;
 
-void stackPush(Stack *stack, Value value);
-Value stackPop(Stack *stack);
-Value stackPeek(Stack *stack, int distance);
-void initStack(Stack *stack);
+static inline void stackPush(Stack *stack, Value value) {
+  *stack->top = value;
+  stack->top++;
+}
+
+static inline Value stackPop(Stack *stack) {
+  stack->top--;
+  return *stack->top;
+}
+
+static inline Value stackPeek(Stack *stack, int distance) {
+  return stack->top[-1 - distance];
+}
+
+void initStack(Stack *stack, size_t slots);
 void resetStack(Stack *stack);
 void freeStack(Stack *stack);
 
-#endif
\ No newline at end of file
+#endif
@@ -4,17 +4,31 @@
 #include "common.h"
 #include "value.h"
 
-typedef struct {
-  ObjString *key;
-  Value value;
-} Entry;
+// slots are probed in groups of this many control bytes at a time
+#define TABLE_GROUP_WIDTH 16
+
+// a control byte per slot: empty, a tombstone, or the low seven bits of
+// the hash of the key in it
+#define CTRL_EMPTY 0x80
+#define CTRL_DELETED 0xfe
 
 typedef struct {
+  // live entries plus tombstones
   int count;
+  // zero or a power of two no smaller than a group
   int capacity;
-  Entry *entries;
+  // one block: the control bytes, then the keys, then the values
+  uint8_t *control;
 } Table;
 
+static inline ObjString **tableKeys(Table *table) {
+  return (ObjString **)(table->control + table->capacity);
+}
+
+static inline Value *tableValues(Table *table) {
+  return (Value *)(tableKeys(table) + table->capacity);
+}
+
 void initTable(Table *table);
 void freeTable(Table *table);
 bool tableGet(Table *table, ObjString *key, Value *value);
@@ -6,11 +6,71 @@
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+// every value fits in 64 bits: numbers are stored as plain doubles and
+// everything else lives inside the unused payload of a quiet NaN
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+// the lowest three bits of a non-object NaN tell which singleton it is.
+// indexes (only used by the compiler) keep their payload above the tag.
+#define TAG_NIL 1       // 001
+#define TAG_FALSE 2     // 010
+#define TAG_TRUE 3      // 011
+#define TAG_IDX 4       // 100
+#define TAG_UNDEFINED 5 // 101
+#define TAG_MASK 7      // 111
+
+typedef uint64_t Value;
+
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) valueToNum(value)
+#define AS_IDX(value) ((uint32_t)((value) >> 3))
+#define AS_OBJ(value) ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_IDX(value)                                                          \
+  (((value) & (SIGN_BIT | QNAN | TAG_MASK)) == (QNAN | TAG_IDX))
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
+#define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+// marks a global slot that has been declared but not yet defined
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(num) numToValue(num)
+#define IDX_VAL(index)                                                         \
+  ((Value)(QNAN | ((uint64_t)(uint32_t)(index) << 3) | TAG_IDX))
+#define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+static inline double valueToNum(Value value) {
+  double num;
+  memcpy(&num, &value, sizeof(Value));
+  return num;
+}
+
+static inline Value numToValue(double num) {
+  Value value;
+  memcpy(&value, &num, sizeof(double));
+  return value;
+}
+
+#else
+
 typedef enum {
   VAL_BOOL,
   VAL_NIL,
   VAL_NUMBER,
   VAL_IDX,
+  VAL_UNDEFINED,
   VAL_OBJ,
 } ValueType;
 
@@ -31,16 +91,21 @@ typedef struct {
 
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_IDX(value) ((value).type == VAL_IDX)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
+// marks a global slot that has been declared but not yet defined
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define IDX_VAL(value) ((Value){VAL_IDX, {.index = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj *)object}})
 
+#endif
+
 typedef struct {
   int capacity;
   int count;
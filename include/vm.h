@@ -7,6 +7,29 @@
 #include "table.h"
 
 #define FRAMES_MAX 64
+// number of value slots in the VM stack, can be overridden at build time
+#ifndef STACK_MAX
+#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+#endif
+// slots a call leaves free on top of what its function needs, for the
+// values natives and the runtime push for a moment
+#define STACK_SCRATCH 16
+// deopts after which an OP_ADD stops being quickened
+#define ADD_DEOPT_LIMIT 4
+// objects marked or swept per slice of a full collection
+#ifndef GC_DEFAULT_BUDGET
+#define GC_DEFAULT_BUDGET 10000
+#endif
+
+// no full collection starts before the heap reaches this many bytes
+#ifndef GC_DEFAULT_INITIAL_HEAP
+#define GC_DEFAULT_INITIAL_HEAP (1024 * 1024)
+#endif
+
+// the heap may grow by this factor between two full collections
+#ifndef GC_DEFAULT_GROWTH
+#define GC_DEFAULT_GROWTH 2.0
+#endif
 
 typedef enum {
   INTERPRET_OK,
@@ -17,26 +40,107 @@ typedef enum {
 typedef struct {
   ObjClosure *closure;
   uint8_t *ip;
-  int base;
+  Value *slots;
 } CallFrame;
 
+typedef enum {
+  GC_IDLE,
+  // a full collection is marking in slices between allocations
+  GC_MARK,
+  // marking is done and the old objects are being swept in slices
+  GC_SWEEP
+} GCPhase;
+
+// what one collection did, a minor one, or a full one from the start of
+// its marking to the end of its sweep. times are in ns, and timestamps
+// count from the start of the VM.
+typedef struct {
+  bool full;
+  uint64_t start;
+  uint64_t end;
+  uint64_t markTime;
+  uint64_t sweepTime;
+  int pauses;
+  uint64_t pauseMax;
+  size_t bytesBefore;
+  size_t bytesAfter;
+  size_t bytesFreed;
+  // most objects waiting to be traced at once
+  int grayMax;
+  uint32_t freed[OBJ_TYPE_COUNT];
+} GCCycle;
+
+// the cycles added up
+typedef struct {
+  int minorCycles;
+  int fullCycles;
+  uint64_t markTime;
+  uint64_t sweepTime;
+  size_t bytesFreed;
+  int grayMax;
+  uint64_t freed[OBJ_TYPE_COUNT];
+} GCStats;
+
 typedef struct {
   CallFrame frames[FRAMES_MAX];
   int frameCount;
 
   Stack stack;
-  Obj *objects;
   Table strings;
   ObjString *initString;
-  Table globals;
+  // classes of the objects gcStats() returns, made once
+  ObjClass *gcStatsClass;
+  ObjClass *gcFreedClass;
+  // global variables live in slots assigned by the compiler. the table
+  // maps each name to its slot, the arrays are indexed by slot.
+  Table globalSlots;
+  ValueArray globalNames;
+  ValueArray globalValues;
   ObjUpvalue *openUpvalues;
+  // bumped when a class with cached methods changes them
+  uint32_t methodEpoch;
 
   size_t bytesAllocated;
   size_t nextGC;
+  size_t nurseryBytes;
   // GC
+  GCPhase gcPhase;
+  size_t gcInitialHeap;
+  double gcGrowth;
+  // a full collection runs when the heap goes over this, and the program
+  // ends if it is still over. 0 for no limit.
+  size_t gcMaxHeap;
+  // bytes allocated since the last slice of the current full collection
+  size_t sliceBytes;
+  // objects marked or swept per slice, 0 collects in one go
+  int gcBudget;
+  // threads that mark in parallel, 1 marks on the main thread only
+  int gcThreads;
+  // sweep on a thread of its own instead of in slices
+  bool gcBackgroundSweep;
+  // move objects out of sparse arenas after full collections
+  bool gcCompact;
+  // a full collection ended, compact at the next safe point if worth it
+  bool compactPending;
+  int pauseCount;
+  uint64_t pauseTotal;
+  uint64_t pauseMax;
+  uint64_t startTime;
+  // the full collection under way, or the last one
+  GCCycle fullCycle;
+  GCStats gcStats;
+  // print every cycle as a line of JSON once it ends
+  bool gcLogCycles;
+  // 0 compiles the code as written, 1 folds constants and runs the
+  // peephole pass over every function
+  int optLevel;
   int grayCount;
   int grayCapacity;
   Obj **grayStack;
+  // old objects written to since the last collection
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj **remembered;
 } VM;
 
 extern VM vm;
@@ -44,5 +148,15 @@ extern VM vm;
 void initVM();
 void freeVM();
 InterpretResult interpret(const char *source);
+// returns the slot of a global variable, adding an undefined one if needed
+uint32_t globalSlot(ObjString *name);
+// prints hit/miss counters of the property caches of live functions
+void printInlineCacheStats();
+// prints the number and length of collection pauses
+void printGCPauses();
+// prints what the collections did in total
+void printGCStats();
+// prints a cycle as one line of JSON
+void printGCCycle(GCCycle *cycle);
 
 #endif
\ No newline at end of file
@@ -3,10 +3,18 @@
 #include "stack.h"
 #include "vm.h"
 
+#include <string.h>
+
 void initChunk(Chunk *chunk) {
   chunk->code = NULL;
   chunk->count = 0;
   chunk->capacity = 0;
+  chunk->caches = NULL;
+  chunk->cacheCount = 0;
+  chunk->cacheCapacity = 0;
+  chunk->constantIndex = NULL;
+  chunk->constantIndexCount = 0;
+  chunk->constantIndexCapacity = 0;
   initValueArray(&chunk->constants);
   initLineArray(&chunk->lines);
 }
@@ -23,33 +31,300 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line) {
   chunk->count++;
 }
 
+void truncateChunk(Chunk *chunk, uint32_t offset) {
+  truncateLineArray(&chunk->lines, chunk->count - offset);
+  chunk->count = offset;
+}
+
 void freeChunk(Chunk *chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
   freeLineArray(&chunk->lines);
   freeValueArray(&chunk->constants);
+  FREE_ARRAY(InlineCache, chunk->caches, chunk->cacheCapacity);
+  freeConstantIndex(chunk);
   initChunk(chunk);
 }
 
+// numbers are told apart by their bits, so 0 and -0 stay two constants,
+// and strings by their address
+static uint64_t constantKey(Value value) {
+#ifdef NAN_BOXING
+  return value;
+#else
+  if (IS_NUMBER(value)) {
+    uint64_t bits;
+    memcpy(&bits, &value.as.number, sizeof(bits));
+    return bits;
+  }
+  return (uint64_t)(uintptr_t)AS_OBJ(value);
+#endif
+}
+
+static uint32_t hashConstant(uint64_t key) {
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdull;
+  key ^= key >> 33;
+  return (uint32_t)key;
+}
+
+// the entry of the index holding value, or the empty one it would go in
+static uint32_t *findConstant(Chunk *chunk, Value value) {
+  uint64_t key = constantKey(value);
+  uint32_t mask = chunk->constantIndexCapacity - 1;
+  for (uint32_t i = hashConstant(key) & mask;; i = (i + 1) & mask) {
+    uint32_t *entry = &chunk->constantIndex[i];
+    if (*entry == 0) {
+      return entry;
+    }
+    Value constant = chunk->constants.values[*entry - 1];
+    if (IS_NUMBER(constant) == IS_NUMBER(value) &&
+        constantKey(constant) == key) {
+      return entry;
+    }
+  }
+}
+
+static void growConstantIndex(Chunk *chunk) {
+  uint32_t oldCapacity = chunk->constantIndexCapacity;
+  uint32_t *oldIndex = chunk->constantIndex;
+  chunk->constantIndexCapacity = GROW_CAPACITY(oldCapacity);
+  chunk->constantIndex = ALLOCATE(uint32_t, chunk->constantIndexCapacity);
+  memset(chunk->constantIndex, 0,
+         sizeof(uint32_t) * chunk->constantIndexCapacity);
+  for (uint32_t i = 0; i < oldCapacity; i++) {
+    if (oldIndex[i] != 0) {
+      Value constant = chunk->constants.values[oldIndex[i] - 1];
+      *findConstant(chunk, constant) = oldIndex[i];
+    }
+  }
+  FREE_ARRAY(uint32_t, oldIndex, oldCapacity);
+}
+
 uint32_t makeConstant(Chunk *chunk, Value value) {
   stackPush(&vm.stack, value);
-  writeValueArray(&chunk->constants, value);
+  if (!IS_NUMBER(value) && !IS_STRING(value)) {
+    writeValueArray(&chunk->constants, value);
+    stackPop(&vm.stack);
+    return chunk->constants.count - 1;
+  }
+
+  if (chunk->constantIndexCount + 1 > chunk->constantIndexCapacity / 4 * 3) {
+    growConstantIndex(chunk);
+  }
+  uint32_t *entry = findConstant(chunk, value);
+  if (*entry == 0) {
+    writeValueArray(&chunk->constants, value);
+    *entry = chunk->constants.count;
+    chunk->constantIndexCount++;
+  }
   stackPop(&vm.stack);
-  return chunk->constants.count - 1;
+  return *entry - 1;
 }
 
-void writeConstant(Chunk *chunk, OpCode code, Value value, int line) {
-  stackPush(&vm.stack, value);
+void freeConstantIndex(Chunk *chunk) {
+  FREE_ARRAY(uint32_t, chunk->constantIndex, chunk->constantIndexCapacity);
+  chunk->constantIndex = NULL;
+  chunk->constantIndexCount = 0;
+  chunk->constantIndexCapacity = 0;
+}
 
-  uint32_t size = chunk->constants.count;
-  if (size >= 256u) {
-    code++;
+void writeConstant(Chunk *chunk, OpCode code, Value value, int line) {
+  uint32_t constant = makeConstant(chunk, value);
+  if (constant > UINT8_MAX) {
+    writeChunk(chunk, code + 1, line);
+    WRITE_LONG_CHUNK(chunk, constant, line);
+  } else {
     writeChunk(chunk, code, line);
-    writeValueArray(&chunk->constants, value);
-    WRITE_LONG_CHUNK(chunk, size, line);
-    return;
+    writeChunk(chunk, constant, line);
   }
-  writeValueArray(&chunk->constants, value);
-  writeChunk(chunk, code, line);
-  writeChunk(chunk, size, line);
-  stackPop(&vm.stack);
-}
\ No newline at end of file
+}
+
+uint32_t makeCache(Chunk *chunk, ObjString *name) {
+  if (chunk->cacheCapacity < chunk->cacheCount + 1) {
+    int oldCapacity = chunk->cacheCapacity;
+    chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->caches = GROW_ARRAY(InlineCache, chunk->caches, oldCapacity,
+                               chunk->cacheCapacity);
+  }
+  InlineCache *cache = &chunk->caches[chunk->cacheCount];
+  cache->name = name;
+  cache->epoch = 0;
+  cache->count = 0;
+  cache->megamorphic = false;
+  cache->hits = 0;
+  cache->misses = 0;
+  return chunk->cacheCount++;
+}
+
+uint32_t readOperand(Chunk *chunk, uint32_t offset, bool isLong) {
+  uint8_t *code = &chunk->code[offset];
+  uint32_t operand = code[1];
+  if (isLong) {
+    operand = (operand << 16) | (code[2] << 8) | code[3];
+  }
+  return operand;
+}
+
+int instructionLength(Chunk *chunk, uint32_t offset) {
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_GET_GLOBAL:
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_CLASS:
+  case OP_GET_PROPERTY:
+  case OP_SET_PROPERTY:
+  case OP_METHOD:
+  case OP_GET_SUPER:
+  case OP_CALL:
+  case OP_SET_LOCAL_POP:
+  case OP_SET_GLOBAL_POP:
+  case OP_ADD:
+  case OP_ADD_NUM:
+  case OP_ADD_STR:
+    return 2;
+  case OP_CONSTANT_LONG:
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_SET_GLOBAL_LONG:
+  case OP_GET_GLOBAL_LONG:
+  case OP_GET_LOCAL_LONG:
+  case OP_SET_LOCAL_LONG:
+  case OP_GET_UPVALUE_LONG:
+  case OP_SET_UPVALUE_LONG:
+  case OP_CLASS_LONG:
+  case OP_GET_PROPERTY_LONG:
+  case OP_SET_PROPERTY_LONG:
+  case OP_METHOD_LONG:
+  case OP_GET_SUPER_LONG:
+    return 4;
+  case OP_INVOKE:
+  case OP_SUPER_INVOKE:
+  case OP_GET_LOCAL_PROPERTY:
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_POP_JUMP_IF_FALSE:
+  case OP_POP_JUMP_IF_TRUE:
+  case OP_LOOP:
+    return 3;
+  case OP_INVOKE_LONG:
+  case OP_SUPER_INVOKE_LONG:
+    return 5;
+  case OP_CLOSURE:
+  case OP_CLOSURE_LONG: {
+    // followed by four bytes for each upvalue
+    bool isLong = chunk->code[offset] == OP_CLOSURE_LONG;
+    uint32_t constant = readOperand(chunk, offset, isLong);
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+    return (isLong ? 4 : 2) + 4 * function->upvalueCount;
+  }
+  default:
+    return 1;
+  }
+}
+
+// how many slots the instruction at offset leaves on the stack, minus the
+// ones it takes
+static int stackEffect(Chunk *chunk, uint32_t offset) {
+  uint8_t *code = &chunk->code[offset];
+  switch (code[0]) {
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+  case OP_GET_GLOBAL:
+  case OP_GET_GLOBAL_LONG:
+  case OP_GET_LOCAL:
+  case OP_GET_LOCAL_LONG:
+  case OP_GET_UPVALUE:
+  case OP_GET_UPVALUE_LONG:
+  case OP_CLOSURE:
+  case OP_CLOSURE_LONG:
+  case OP_CLASS:
+  case OP_CLASS_LONG:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_LOCAL_PROPERTY:
+    return 1;
+  case OP_DEFINE_GLOBAL:
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_CLOSE_UPVALUE:
+  case OP_SET_PROPERTY:
+  case OP_SET_PROPERTY_LONG:
+  case OP_METHOD:
+  case OP_METHOD_LONG:
+  case OP_GET_SUPER:
+  case OP_GET_SUPER_LONG:
+  case OP_INHERIT:
+  case OP_POP:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_PRINT:
+  case OP_SET_LOCAL_POP:
+  case OP_SET_GLOBAL_POP:
+  case OP_POP_JUMP_IF_FALSE:
+  case OP_POP_JUMP_IF_TRUE:
+  case OP_ADD_NUM:
+  case OP_ADD_STR:
+    return -1;
+  case OP_CALL:
+    return -code[1];
+  case OP_INVOKE:
+    return -code[2];
+  case OP_INVOKE_LONG:
+    return -code[4];
+  // the superclass is popped as well
+  case OP_SUPER_INVOKE:
+    return -code[2] - 1;
+  case OP_SUPER_INVOKE_LONG:
+    return -code[4] - 1;
+  default:
+    return 0;
+  }
+}
+
+int maxStackSlots(Chunk *chunk, int slots) {
+  // the depth at each jump target, -1 until a jump to it is seen. jumps
+  // only go backwards to loop starts, which have been walked already.
+  int *targetSlots = ALLOCATE(int, chunk->count + 1);
+  for (uint32_t i = 0; i <= chunk->count; i++) {
+    targetSlots[i] = -1;
+  }
+
+  int max = slots;
+  bool reachable = true;
+  for (uint32_t offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    if (targetSlots[offset] != -1 &&
+        (!reachable || targetSlots[offset] > slots)) {
+      slots = targetSlots[offset];
+    }
+    reachable = true;
+
+    uint8_t op = chunk->code[offset];
+    slots += stackEffect(chunk, offset);
+    if (slots > max) {
+      max = slots;
+    }
+    if (op == OP_JUMP || op == OP_JUMP_IF_FALSE ||
+        op == OP_POP_JUMP_IF_FALSE || op == OP_POP_JUMP_IF_TRUE) {
+      uint32_t target = offset + 3 + ((chunk->code[offset + 1] << 8) |
+                                      chunk->code[offset + 2]);
+      if (targetSlots[target] < slots) {
+        targetSlots[target] = slots;
+      }
+    }
+    if (op == OP_JUMP || op == OP_LOOP || op == OP_RETURN) {
+      reachable = false;
+    }
+  }
+  FREE_ARRAY(int, targetSlots, chunk->count + 1);
+  return max;
+}
@@ -1,8 +1,10 @@
 #include "compiler.h"
 #include "chunk.h"
 #include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
 
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -65,11 +67,22 @@ typedef struct Compiler {
   FunctionType type;
 
   Upvalue upvalues[UINT8_COUNT];
-  Table identifiers;
   uint32_t localCount;
   uint32_t localCapacity;
   int scopeDepth;
   Local *locals;
+  // start of the last emitted instruction that may be fused with the
+  // next one, or -1. nothing is fused across a jump target.
+  int fusable;
+  // start of the last emitted instruction that loads a constant, or -1.
+  // operators are folded when their operands are such loads.
+  int constantStart;
+  // where the last instruction known to leave a number, or a bool, on
+  // the stack ends, and where the last OP_NOT applied to a bool ends. the
+  // identities that only hold for one type look at these.
+  int numberEnd;
+  int boolEnd;
+  int notEnd;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -88,11 +101,15 @@ static void initCompiler(Compiler *compiler, FunctionType type) {
   compiler->function = NULL;
   compiler->type = type;
 
-  initTable(&compiler->identifiers);
   compiler->localCount = 0;
   compiler->localCapacity = 0;
   compiler->locals = NULL;
   compiler->scopeDepth = 0;
+  compiler->fusable = -1;
+  compiler->constantStart = -1;
+  compiler->numberEnd = -1;
+  compiler->boolEnd = -1;
+  compiler->notEnd = -1;
   compiler->function = newFunction();
 
   current = compiler;
@@ -214,6 +231,13 @@ static void emitReturn() {
 static ObjFunction *endCompiler() {
   ObjFunction *function = current->function;
   emitReturn();
+  if (vm.optLevel > 0 && !parser.hadError) {
+    optimizeChunk(currentChunk());
+  }
+  freeConstantIndex(currentChunk());
+  if (!parser.hadError) {
+    function->maxSlots = maxStackSlots(currentChunk(), function->arity + 1);
+  }
 #ifdef DEBUG_PRINT_CODE
   if (!parser.hadError) {
     disassembleChunk(currentChunk(), function->name != NULL
@@ -222,6 +246,8 @@ static ObjFunction *endCompiler() {
   }
 #endif
   current = current->enclosing;
+  // covers the writes made to it since the last collection
+  writeBarrier((Obj *)function);
   return function;
 }
 
@@ -247,14 +273,12 @@ static ParseRule *getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 
 static uint32_t identifierConstant(Token *name) {
-  ObjString *identifier = copyString(name->start, name->length);
-  Value value;
-  if (tableGet(&current->identifiers, identifier, &value)) {
-    return AS_IDX(value);
-  }
-  uint32_t constant = makeConstant(currentChunk(), OBJ_VAL(identifier));
-  tableSet(&current->identifiers, identifier, IDX_VAL(constant));
-  return constant;
+  return makeConstant(currentChunk(),
+                      OBJ_VAL(copyString(name->start, name->length)));
+}
+
+static uint32_t globalVariable(Token *name) {
+  return globalSlot(copyString(name->start, name->length));
 }
 
 static bool identifiersEqual(Token *a, Token *b) {
@@ -353,7 +377,7 @@ static uint32_t parseVariable(const char *errorMessage) {
     return 0;
   }
 
-  return identifierConstant(&parser.previous);
+  return globalVariable(&parser.previous);
 }
 
 static void markInitialized() {
@@ -398,6 +422,38 @@ static void patchJump(int offset) {
 
   currentChunk()->code[offset] = (jump >> 8) & 0xff;
   currentChunk()->code[offset + 1] = jump & 0xff;
+  current->fusable = -1;
+  current->constantStart = -1;
+  current->numberEnd = -1;
+  current->boolEnd = -1;
+  current->notEnd = -1;
+}
+
+// marks the instruction about to be emitted as a candidate for fusing
+static void markFusable(uint32_t operand) {
+  current->fusable = operand > UINT8_MAX ? -1 : (int)currentChunk()->count;
+}
+
+// returns the opcode of the last instruction if it can be fused
+static int lastFusable() {
+  if (current->fusable == -1 ||
+      current->fusable + 2 != (int)currentChunk()->count) {
+    return -1;
+  }
+  return currentChunk()->code[current->fusable];
+}
+
+// pops the value of an expression statement. an assignment whose value is
+// dropped right away stores and pops in one instruction.
+static void emitPop() {
+  int last = lastFusable();
+  if (last == OP_SET_LOCAL || last == OP_SET_GLOBAL) {
+    currentChunk()->code[current->fusable] =
+        last == OP_SET_LOCAL ? OP_SET_LOCAL_POP : OP_SET_GLOBAL_POP;
+    current->fusable = -1;
+    return;
+  }
+  emitByte(OP_POP);
 }
 
 static void and_(bool _) {
@@ -421,9 +477,155 @@ static void or_(bool canAssign) {
 }
 
 static void emitConstant(Value value) {
+  current->constantStart = currentChunk()->count;
   writeConstant(currentChunk(), OP_CONSTANT, value, parser.previous.line);
 }
 
+// loads value with the shortest instruction there is for it
+static void emitValue(Value value) {
+  if (IS_NIL(value)) {
+    current->constantStart = currentChunk()->count;
+    emitByte(OP_NIL);
+  } else if (IS_BOOL(value)) {
+    current->constantStart = currentChunk()->count;
+    emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else {
+    emitConstant(value);
+  }
+}
+
+static int constantLength(uint8_t instruction) {
+  switch (instruction) {
+  case OP_CONSTANT:
+    return 2;
+  case OP_CONSTANT_LONG:
+    return 4;
+  default:
+    return 1;
+  }
+}
+
+// the start of the last instruction if it loads a constant, or -1
+static int lastConstant() {
+  int start = current->constantStart;
+  if (start == -1 || vm.optLevel == 0 ||
+      start + constantLength(currentChunk()->code[start]) !=
+          (int)currentChunk()->count) {
+    return -1;
+  }
+  return start;
+}
+
+static Value constantAt(int offset) {
+  Chunk *chunk = currentChunk();
+  uint8_t *code = &chunk->code[offset];
+  switch (code[0]) {
+  case OP_NIL:
+    return NIL_VAL;
+  case OP_TRUE:
+    return BOOL_VAL(true);
+  case OP_FALSE:
+    return BOOL_VAL(false);
+  case OP_CONSTANT:
+    return chunk->constants.values[code[1]];
+  default:
+    return chunk->constants.values[(code[1] << 16) | (code[2] << 8) |
+                                   code[3]];
+  }
+}
+
+// drops the code from offset on, it is replaced by something shorter
+static void truncateCode(int offset) {
+  truncateChunk(currentChunk(), offset);
+  if (current->fusable >= offset) {
+    current->fusable = -1;
+  }
+}
+
+// folds the operator into the constant load at operand when it is known
+// what it evaluates to, anything that would be a runtime error is not
+static bool foldUnary(TokenType operatorType, int operand) {
+  Value value = constantAt(operand);
+  Value result;
+  if (operatorType == TOKEN_BANG) {
+    result = BOOL_VAL(IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)));
+  } else if (IS_NUMBER(value)) {
+    result = NUMBER_VAL(-AS_NUMBER(value));
+  } else {
+    return false;
+  }
+  truncateCode(operand);
+  emitValue(result);
+  return true;
+}
+
+static bool foldBinary(TokenType operatorType, int left, int right) {
+  Value a = constantAt(left);
+  Value b = constantAt(right);
+  Value result;
+  if (operatorType == TOKEN_EQUAL_EQUAL || operatorType == TOKEN_BANG_EQUAL) {
+    result = BOOL_VAL(valuesEqual(a, b) == (operatorType == TOKEN_EQUAL_EQUAL));
+  } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (operatorType) {
+    case TOKEN_PLUS:
+      result = NUMBER_VAL(x + y);
+      break;
+    case TOKEN_MINUS:
+      result = NUMBER_VAL(x - y);
+      break;
+    case TOKEN_STAR:
+      result = NUMBER_VAL(x * y);
+      break;
+    case TOKEN_SLASH:
+      result = NUMBER_VAL(x / y);
+      break;
+    // the same comparisons the instructions emitted for them make
+    case TOKEN_GREATER:
+      result = BOOL_VAL(x > y);
+      break;
+    case TOKEN_GREATER_EQUAL:
+      result = BOOL_VAL(!(x < y));
+      break;
+    case TOKEN_LESS:
+      result = BOOL_VAL(x < y);
+      break;
+    case TOKEN_LESS_EQUAL:
+      result = BOOL_VAL(!(x > y));
+      break;
+    default:
+      return false;
+    }
+  } else if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+    // both are in the constant table, so they stay reachable
+    Obj *string = concatenateStrings(AS_OBJ(a), AS_OBJ(b));
+    result = OBJ_VAL(asFlatString(OBJ_VAL(string)));
+  } else {
+    return false;
+  }
+  truncateCode(left);
+  emitValue(result);
+  return true;
+}
+
+// x * 1, x / 1 and x - 0 are x for any number, NaN and -0 included
+static bool isIdentity(TokenType operatorType, Value value) {
+  if (!IS_NUMBER(value)) {
+    return false;
+  }
+  double y = AS_NUMBER(value);
+  switch (operatorType) {
+  case TOKEN_STAR:
+  case TOKEN_SLASH:
+    return y == 1;
+  case TOKEN_MINUS:
+    return y == 0 && !signbit(y);
+  default:
+    return false;
+  }
+}
+
 static void number(bool canAssign) {
   double value = strtod(parser.previous.start, NULL);
   emitConstant(NUMBER_VAL(value));
@@ -445,17 +647,20 @@ static OpCode getInstructionForNamedVariable(Token name, bool canAssign) {
 static void handleLocal(bool canAssign, uint32_t localIdx) {
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
+    markFusable(localIdx);
     WRITE_OPERATION(currentChunk(), localIdx, OP_SET_LOCAL);
   } else {
+    markFusable(localIdx);
     WRITE_OPERATION(currentChunk(), localIdx, OP_GET_LOCAL);
   }
 }
 
 static void handleGlobal(Token name, bool canAssign) {
-  uint32_t arg = identifierConstant(&name);
+  uint32_t arg = globalVariable(&name);
   OpCode operation;
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
+    markFusable(arg);
     WRITE_OPERATION(currentChunk(), arg, OP_SET_GLOBAL);
   } else {
     WRITE_OPERATION(currentChunk(), arg, OP_GET_GLOBAL);
@@ -494,6 +699,11 @@ static Token syntheticToken(const char *text) {
   return token;
 }
 
+static uint32_t propertyCache(uint32_t name) {
+  Value constant = currentChunk()->constants.values[name];
+  return makeCache(currentChunk(), AS_STRING(constant));
+}
+
 static void super_(bool canAssign) {
   if (currentClass == NULL) {
     error("Can't use 'super' outside of a class.");
@@ -509,11 +719,13 @@ static void super_(bool canAssign) {
   if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
     namedVariable(syntheticToken("super"), false);
-    WRITE_OPERATION(currentChunk(), name, OP_SUPER_INVOKE);
+    uint32_t cache = propertyCache(name);
+    WRITE_OPERATION(currentChunk(), cache, OP_SUPER_INVOKE);
     emitByte(argCount);
   } else {
     namedVariable(syntheticToken("super"), false);
-    WRITE_OPERATION(currentChunk(), name, OP_GET_SUPER);
+    uint32_t cache = propertyCache(name);
+    WRITE_OPERATION(currentChunk(), cache, OP_GET_SUPER);
   }
 }
 
@@ -524,17 +736,35 @@ static void grouping(bool canAssign) {
 
 static void unary(bool canAssign) {
   TokenType operatorType = parser.previous.type;
+  int operand = currentChunk()->count;
 
   // Compile the operand.
   parsePrecedence(PREC_UNARY);
+  if (lastConstant() == operand && foldUnary(operatorType, operand)) {
+    return;
+  }
 
   // Emit the operator instruction.
   switch (operatorType) {
-  case TOKEN_BANG:
+  case TOKEN_BANG: {
+    int end = currentChunk()->count;
+    if (current->notEnd == end && vm.optLevel > 0) {
+      // !!b is b when b is a bool
+      truncateCode(end - 1);
+      current->boolEnd = end - 1;
+      current->notEnd = -1;
+      return;
+    }
     emitByte(OP_NOT);
+    if (current->boolEnd == end) {
+      current->notEnd = end + 1;
+    }
+    current->boolEnd = end + 1;
     break;
+  }
   case TOKEN_MINUS:
     emitByte(OP_NEGATE);
+    current->numberEnd = currentChunk()->count;
     break;
   default:
     return; // Unreachable.
@@ -543,9 +773,23 @@ static void unary(bool canAssign) {
 
 static void binary(bool canAssign) {
   TokenType operatorType = parser.previous.type;
+  int left = lastConstant();
+  int right = currentChunk()->count;
+  bool leftIsNumber = current->numberEnd == right;
   ParseRule *rule = getRule(operatorType);
   parsePrecedence((Precedence)(rule->precedence + 1));
 
+  if (lastConstant() == right) {
+    if (left != -1 && foldBinary(operatorType, left, right)) {
+      return;
+    }
+    if (leftIsNumber && isIdentity(operatorType, constantAt(right))) {
+      truncateCode(right);
+      current->numberEnd = right;
+      return;
+    }
+  }
+
   switch (operatorType) {
   case TOKEN_BANG_EQUAL:
     emitBytes(OP_EQUAL, OP_NOT);
@@ -566,7 +810,8 @@ static void binary(bool canAssign) {
     emitBytes(OP_GREATER, OP_NOT);
     break;
   case TOKEN_PLUS:
-    emitByte(OP_ADD);
+    // counts how often the interpreter had to undo its quickening
+    emitBytes(OP_ADD, 0);
     break;
   case TOKEN_MINUS:
     emitByte(OP_SUBTRACT);
@@ -580,6 +825,27 @@ static void binary(bool canAssign) {
   default:
     return; // Unreachable.
   }
+
+  int end = currentChunk()->count;
+  switch (operatorType) {
+  case TOKEN_PLUS:
+    break;
+  case TOKEN_MINUS:
+  case TOKEN_STAR:
+  case TOKEN_SLASH:
+    current->numberEnd = end;
+    break;
+  case TOKEN_BANG_EQUAL:
+  case TOKEN_GREATER_EQUAL:
+  case TOKEN_LESS_EQUAL:
+    // the comparison is a bool, so the OP_NOT after it is one too
+    current->notEnd = end;
+    current->boolEnd = end;
+    break;
+  default:
+    current->boolEnd = end;
+    break;
+  }
 }
 
 static void call(bool canAssign) {
@@ -594,17 +860,27 @@ static void dot(bool canAssign) {
 
   if (canAssign && match(TOKEN_EQUAL)) {
     expression();
-    WRITE_OPERATION(currentChunk(), name, OP_SET_PROPERTY);
+    uint32_t cache = propertyCache(name);
+    WRITE_OPERATION(currentChunk(), cache, OP_SET_PROPERTY);
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t argCount = argumentList();
-    WRITE_OPERATION(currentChunk(), name, OP_INVOKE);
+    uint32_t cache = propertyCache(name);
+    WRITE_OPERATION(currentChunk(), cache, OP_INVOKE);
     emitByte(argCount);
   } else {
-    WRITE_OPERATION(currentChunk(), name, OP_GET_PROPERTY);
+    uint32_t cache = propertyCache(name);
+    if (lastFusable() == OP_GET_LOCAL && cache <= UINT8_MAX) {
+      currentChunk()->code[current->fusable] = OP_GET_LOCAL_PROPERTY;
+      current->fusable = -1;
+      emitByte(cache);
+      return;
+    }
+    WRITE_OPERATION(currentChunk(), cache, OP_GET_PROPERTY);
   }
 }
 
 static void literal(bool canAssign) {
+  current->constantStart = currentChunk()->count;
   switch (parser.previous.type) {
   case TOKEN_FALSE:
     emitByte(OP_FALSE);
@@ -712,7 +988,7 @@ static void varDeclaration() {
 static void expressionStatement() {
   expression();
   consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-  emitByte(OP_POP);
+  emitPop();
 }
 
 static void forStatement() {
@@ -737,8 +1013,7 @@ static void forStatement() {
     consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
 
     // Jump out of the loop if the condition is false.
-    exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP); // Condition.
+    exitJump = emitJump(OP_POP_JUMP_IF_FALSE);
   }
 
   // increment clause
@@ -746,7 +1021,7 @@ static void forStatement() {
     int bodyJump = emitJump(OP_JUMP);
     int incrementStart = currentChunk()->count;
     expression();
-    emitByte(OP_POP);
+    emitPop();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
     emitLoop(loopStart);
@@ -758,7 +1033,6 @@ static void forStatement() {
   emitLoop(loopStart);
   if (exitJump != -1) {
     patchJump(exitJump);
-    emitByte(OP_POP); // Condition.
   }
   endScope();
 }
@@ -775,18 +1049,17 @@ static void ifStatement() {
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-  int thenJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
+  int thenJump = emitJump(OP_POP_JUMP_IF_FALSE);
   statement();
 
-  int elseJump = emitJump(OP_JUMP);
-  patchJump(thenJump);
-  emitByte(OP_POP);
-
   if (match(TOKEN_ELSE)) {
+    int elseJump = emitJump(OP_JUMP);
+    patchJump(thenJump);
     statement();
+    patchJump(elseJump);
+  } else {
+    patchJump(thenJump);
   }
-  patchJump(elseJump);
 }
 
 static void printStatement() {
@@ -817,13 +1090,11 @@ static void whileStatement() {
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-  int exitJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
+  int exitJump = emitJump(OP_POP_JUMP_IF_FALSE);
   statement();
   emitLoop(loopStart);
 
   patchJump(exitJump);
-  emitByte(OP_POP);
 }
 
 static void synchronize() {
@@ -906,9 +1177,10 @@ static void classDeclaration() {
   Token className = parser.previous;
   uint32_t nameConstant = identifierConstant(&parser.previous);
   declareVariable();
+  uint32_t global = current->scopeDepth > 0 ? 0 : globalVariable(&className);
 
   WRITE_OPERATION(currentChunk(), nameConstant, OP_CLASS);
-  defineVariable(nameConstant);
+  defineVariable(global);
 
   ClassCompiler classCompiler;
   classCompiler.enclosing = currentClass;
@@ -1012,6 +1284,9 @@ void markCompilerRoots() {
   Compiler *compiler = current;
   while (compiler != NULL) {
     markObject((Obj *)compiler->function);
+    // functions being compiled are written to all the time without a
+    // write barrier, so they are always traced again
+    writeBarrier((Obj *)compiler->function);
     compiler = compiler->enclosing;
   }
 }
\ No newline at end of file
@@ -1,7 +1,9 @@
 #include "debug.h"
 #include "chunk.h"
 #include "line.h"
+#include "vm.h"
 
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -40,13 +42,28 @@ static int constantInstruction(bool isLong, const char *name, Chunk *chunk,
   return offset + (isLong ? 4 : 2);
 }
 
+static int cacheInstruction(bool isLong, const char *name, Chunk *chunk,
+                            int offset) {
+  uint32_t cache = readConstant(chunk, isLong, offset);
+  printf("%-16s %4d '%s'\n", name, cache, chunk->caches[cache].name->chars);
+  return offset + (isLong ? 4 : 2);
+}
+
+static int globalInstruction(bool isLong, const char *name, Chunk *chunk,
+                             int offset) {
+  uint32_t slot = readConstant(chunk, isLong, offset);
+  printf("%-16s %4d '", name, slot);
+  printValue(vm.globalNames.values[slot]);
+  printf("'\n");
+  return offset + (isLong ? 4 : 2);
+}
+
 static int invokeInstruction(bool isLong, const char *name, Chunk *chunk,
                              int offset) {
-  uint32_t constant = readConstant(chunk, isLong, offset);
+  uint32_t cache = readConstant(chunk, isLong, offset);
   uint8_t argCount = chunk->code[offset + (isLong ? 4 : 2)];
-  printf("%-16s (%d args) %4d '", name, argCount, constant);
-  printValue(chunk->constants.values[constant]);
-  printf("'\n");
+  printf("%-16s (%d args) %4d '%s'\n", name, argCount, cache,
+         chunk->caches[cache].name->chars);
   return offset + (isLong ? 5 : 3);
 }
 
@@ -85,18 +102,18 @@ int disassembleInstruction(Chunk *chunk, int offset) {
   case OP_DEFINE_GLOBAL_LONG:
     isLong = true;
   case OP_DEFINE_GLOBAL:
-    return constantInstruction(
+    return globalInstruction(
         isLong, isLong ? "OP_DEFINE_GLOBAL_LONG" : "OP_DEFINE_GLOBAL", chunk,
         offset);
   case OP_GET_GLOBAL_LONG:
     isLong = true;
   case OP_GET_GLOBAL:
-    return constantInstruction(
+    return globalInstruction(
         isLong, isLong ? "OP_GET_GLOBAL_LONG" : "OP_GET_GLOBAL", chunk, offset);
   case OP_SET_GLOBAL_LONG:
     isLong = true;
   case OP_SET_GLOBAL:
-    return constantInstruction(
+    return globalInstruction(
         isLong, isLong ? "OP_SET_GLOBAL_LONG" : "OP_SET_GLOBAL", chunk, offset);
   case OP_GET_UPVALUE_LONG:
     isLong = true;
@@ -133,15 +150,15 @@ int disassembleInstruction(Chunk *chunk, int offset) {
   case OP_GET_PROPERTY_LONG:
     isLong = true;
   case OP_GET_PROPERTY:
-    return constantInstruction(
-        isLong, isLong ? "OP_GET_PROPERTY_LONG" : "OP_GET_PROPERTY", chunk,
-        offset);
+    return cacheInstruction(isLong,
+                            isLong ? "OP_GET_PROPERTY_LONG" : "OP_GET_PROPERTY",
+                            chunk, offset);
   case OP_SET_PROPERTY_LONG:
     isLong = true;
   case OP_SET_PROPERTY:
-    return constantInstruction(
-        isLong, isLong ? "OP_SET_PROPERTY_LONG" : "OP_SET_PROPERTY", chunk,
-        offset);
+    return cacheInstruction(isLong,
+                            isLong ? "OP_SET_PROPERTY_LONG" : "OP_SET_PROPERTY",
+                            chunk, offset);
   case OP_METHOD_LONG:
     isLong = true;
   case OP_METHOD:
@@ -161,8 +178,9 @@ int disassembleInstruction(Chunk *chunk, int offset) {
   case OP_GET_SUPER_LONG:
     isLong = true;
   case OP_GET_SUPER:
-    return constantInstruction(
-        isLong, isLong ? "OP_GET_SUPER_LONG" : "OP_GET_SUPER", chunk, offset);
+    return cacheInstruction(isLong,
+                            isLong ? "OP_GET_SUPER_LONG" : "OP_GET_SUPER",
+                            chunk, offset);
   case OP_INHERIT:
     return simpleInstruction("OP_INHERIT", offset);
   case OP_RETURN:
@@ -174,7 +192,7 @@ int disassembleInstruction(Chunk *chunk, int offset) {
   case OP_POP:
     return simpleInstruction("OP_POP", offset);
   case OP_ADD:
-    return simpleInstruction("OP_ADD", offset);
+    return byteInstruction(false, "OP_ADD", chunk, offset);
   case OP_SUBTRACT:
     return simpleInstruction("OP_SUBTRACT", offset);
   case OP_MULTIPLY:
@@ -195,6 +213,25 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return simpleInstruction("OP_GREATER", offset);
   case OP_LESS:
     return simpleInstruction("OP_LESS", offset);
+  case OP_GET_LOCAL_PROPERTY: {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t cache = chunk->code[offset + 2];
+    printf("%-16s %4d %4d '%s'\n", "OP_GET_LOCAL_PROPERTY", slot, cache,
+           chunk->caches[cache].name->chars);
+    return offset + 3;
+  }
+  case OP_SET_LOCAL_POP:
+    return byteInstruction(false, "OP_SET_LOCAL_POP", chunk, offset);
+  case OP_SET_GLOBAL_POP:
+    return globalInstruction(false, "OP_SET_GLOBAL_POP", chunk, offset);
+  case OP_POP_JUMP_IF_FALSE:
+    return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+  case OP_POP_JUMP_IF_TRUE:
+    return jumpInstruction("OP_POP_JUMP_IF_TRUE", 1, chunk, offset);
+  case OP_ADD_NUM:
+    return byteInstruction(false, "OP_ADD_NUM", chunk, offset);
+  case OP_ADD_STR:
+    return byteInstruction(false, "OP_ADD_STR", chunk, offset);
   case OP_JUMP:
     return jumpInstruction("OP_JUMP", 1, chunk, offset);
   case OP_JUMP_IF_FALSE:
@@ -227,3 +264,19 @@ int disassembleInstruction(Chunk *chunk, int offset) {
     return offset + 1;
   }
 }
+
+void printCacheStats(Chunk *chunk, const char *name) {
+  for (uint32_t i = 0; i < chunk->cacheCount; i++) {
+    InlineCache *cache = &chunk->caches[i];
+    if (cache->hits == 0 && cache->misses == 0) {
+      continue;
+    }
+    const char *state = cache->megamorphic ? "megamorphic"
+                        : cache->count > 1 ? "polymorphic"
+                                           : "monomorphic";
+    fprintf(stderr,
+            "%-20s %4u %-16s %-12s hits %10" PRIu64 " misses %10" PRIu64
+            "\n",
+            name, i, cache->name->chars, state, cache->hits, cache->misses);
+  }
+}
@@ -0,0 +1,556 @@
+#include "heap.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// free cells stay poisoned under AddressSanitizer, so using an object after
+// it was swept is still reported even though its memory gets reused
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#define POISON(pointer, size) ASAN_POISON_MEMORY_REGION(pointer, size)
+#define UNPOISON(pointer, size) ASAN_UNPOISON_MEMORY_REGION(pointer, size)
+#else
+#define POISON(pointer, size) ((void)(pointer), (void)(size))
+#define UNPOISON(pointer, size) ((void)(pointer), (void)(size))
+#endif
+
+// the first cell of an arena starts after its header
+#define ARENA_HEADER                                                           \
+  ((sizeof(Arena) + HEAP_GRANULE - 1) & ~(size_t)(HEAP_GRANULE - 1))
+
+// arenas at most 1 / COMPACT_OCCUPANCY full are evacuated, once there are
+// COMPACT_MIN_ARENAS of them
+#define COMPACT_OCCUPANCY 4
+#define COMPACT_MIN_ARENAS 4
+
+int heapSharing = 0;
+
+static struct {
+  FreeLists free;
+  // the unused end of the last arena of each size class
+  uint8_t *bump[HEAP_CLASS_COUNT];
+  uint8_t *limit[HEAP_CLASS_COUNT];
+  Arena *arenas;
+  Arena *youngArenas;
+  // the sweeper may free old large objects while the program allocates
+  pthread_mutex_t largeLock;
+  LargeObject *youngLarge;
+  LargeObject *oldLarge;
+  // the next arena to sweep
+  Arena *sweepArena;
+  bool sweepLarge;
+  // arenas moved out of by heapEvacuate, not yet unmapped
+  Arena *evacuated;
+} heap = {.largeLock = PTHREAD_MUTEX_INITIALIZER};
+
+static bool sharing() {
+  return __atomic_load_n(&heapSharing, __ATOMIC_RELAXED);
+}
+
+static uint64_t loadBits(uint64_t *word) {
+  return sharing() ? __atomic_load_n(word, __ATOMIC_ACQUIRE) : *word;
+}
+
+static void setBits(uint64_t *word, uint64_t bits) {
+  if (sharing()) {
+    __atomic_fetch_or(word, bits, __ATOMIC_ACQ_REL);
+  } else {
+    *word |= bits;
+  }
+}
+
+static void clearBits(uint64_t *word, uint64_t bits) {
+  if (sharing()) {
+    __atomic_fetch_and(word, ~bits, __ATOMIC_ACQ_REL);
+  } else {
+    *word &= ~bits;
+  }
+}
+
+static int sizeClass(size_t size) {
+  return (int)((size + HEAP_GRANULE - 1) / HEAP_GRANULE) - 1;
+}
+
+static size_t cellSize(int sizeClass) {
+  return (size_t)(sizeClass + 1) * HEAP_GRANULE;
+}
+
+static void *cellAt(Arena *arena, int word, int bit) {
+  return (uint8_t *)arena + ((size_t)word * 64 + bit) * HEAP_GRANULE;
+}
+
+void initFreeLists(FreeLists *lists) {
+  for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+    lists->heads[i] = NULL;
+    lists->tails[i] = NULL;
+  }
+}
+
+// maps twice the size and trims it, so the arena is aligned to its size.
+// fresh pages are zeroed, which leaves every cell free and unmarked.
+static void newArena(int sizeClass) {
+  size_t size = HEAP_ARENA_SIZE;
+  uint8_t *mapping = mmap(NULL, size * 2, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "Could not allocate a heap arena.\n");
+    exit(1);
+  }
+  uintptr_t start = ((uintptr_t)mapping + size - 1) & ~(uintptr_t)(size - 1);
+  uint8_t *arena = (uint8_t *)start;
+  if (arena > mapping) {
+    munmap(mapping, arena - mapping);
+  }
+  munmap(arena + size, mapping + size - arena);
+
+  Arena *header = (Arena *)arena;
+  header->next = heap.arenas;
+  header->sizeClass = sizeClass;
+  heap.arenas = header;
+  heap.bump[sizeClass] = arena + ARENA_HEADER;
+  heap.limit[sizeClass] = arena + size;
+}
+
+static void linkLarge(LargeObject **list, LargeObject *object) {
+  object->prev = NULL;
+  object->next = *list;
+  if (*list != NULL) {
+    (*list)->prev = object;
+  }
+  *list = object;
+}
+
+static void unlinkLarge(LargeObject **list, LargeObject *object) {
+  if (object->prev != NULL) {
+    object->prev->next = object->next;
+  } else {
+    *list = object->next;
+  }
+  if (object->next != NULL) {
+    object->next->prev = object->prev;
+  }
+}
+
+static void *allocateLarge(size_t size) {
+  LargeObject *object = (LargeObject *)malloc(sizeof(LargeObject) + size);
+  if (object == NULL)
+    exit(1);
+  object->size = size;
+  object->isMarked = false;
+  object->isYoung = true;
+  pthread_mutex_lock(&heap.largeLock);
+  linkLarge(&heap.youngLarge, object);
+  pthread_mutex_unlock(&heap.largeLock);
+  return object + 1;
+}
+
+static void freeLarge(void *pointer) {
+  LargeObject *object = (LargeObject *)pointer - 1;
+  pthread_mutex_lock(&heap.largeLock);
+  unlinkLarge(object->isYoung ? &heap.youngLarge : &heap.oldLarge, object);
+  pthread_mutex_unlock(&heap.largeLock);
+  free(object);
+}
+
+// a free cell of the size class, with none of its bits set yet
+static Cell *takeCell(int index) {
+  size_t bytes = cellSize(index);
+  Cell *cell = heap.free.heads[index];
+  if (cell != NULL) {
+    UNPOISON(cell, bytes);
+    heap.free.heads[index] = cell->next;
+    if (cell->next == NULL) {
+      heap.free.tails[index] = NULL;
+    }
+    return cell;
+  }
+
+  if (heap.bump[index] == NULL ||
+      heap.bump[index] + bytes > heap.limit[index]) {
+    newArena(index);
+  }
+  cell = (Cell *)heap.bump[index];
+  heap.bump[index] += bytes;
+  return cell;
+}
+
+static void linkYoung(Arena *arena) {
+  if (!arena->hasYoung) {
+    arena->hasYoung = true;
+    arena->nextYoung = heap.youngArenas;
+    heap.youngArenas = arena;
+  }
+}
+
+void *heapAllocate(size_t size) {
+  if (size > HEAP_MAX_CELL) {
+    return allocateLarge(size);
+  }
+
+  Cell *cell = takeCell(sizeClass(size));
+  Arena *arena = arenaOf(cell);
+  size_t granule = granuleOf(cell);
+  setBits(&arena->young[granule / 64], (uint64_t)1 << (granule % 64));
+  linkYoung(arena);
+  return cell;
+}
+
+void heapFreeTo(FreeLists *lists, void *object, size_t size) {
+  if (size > HEAP_MAX_CELL) {
+    freeLarge(object);
+    return;
+  }
+
+  // cells freed by the sweeps already had their bits cleared
+  Arena *arena = arenaOf(object);
+  size_t granule = granuleOf(object);
+  uint64_t bit = (uint64_t)1 << (granule % 64);
+  if (loadBits(&arena->old[granule / 64]) & bit) {
+    clearBits(&arena->old[granule / 64], bit);
+  }
+  if (loadBits(&arena->young[granule / 64]) & bit) {
+    clearBits(&arena->young[granule / 64], bit);
+  }
+
+  int index = sizeClass(size);
+  Cell *cell = (Cell *)object;
+  cell->next = lists->heads[index];
+  if (lists->heads[index] == NULL) {
+    lists->tails[index] = cell;
+  }
+  lists->heads[index] = cell;
+  POISON(cell, cellSize(index));
+}
+
+void heapFree(void *object, size_t size) {
+  heapFreeTo(&heap.free, object, size);
+}
+
+void heapReclaim(FreeLists *lists) {
+  for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+    Cell *tail = lists->tails[i];
+    if (tail == NULL) {
+      continue;
+    }
+    UNPOISON(tail, sizeof(Cell));
+    tail->next = heap.free.heads[i];
+    POISON(tail, cellSize(i));
+    if (heap.free.heads[i] == NULL) {
+      heap.free.tails[i] = tail;
+    }
+    heap.free.heads[i] = lists->heads[i];
+  }
+  initFreeLists(lists);
+}
+
+void heapClearMarks() {
+  for (Arena *arena = heap.arenas; arena != NULL; arena = arena->next) {
+    memset(arena->marked, 0, sizeof(arena->marked));
+  }
+  LargeObject *lists[] = {heap.youngLarge, heap.oldLarge};
+  for (int i = 0; i < 2; i++) {
+    for (LargeObject *object = lists[i]; object != NULL;
+         object = object->next) {
+      object->isMarked = false;
+    }
+  }
+}
+
+void heapSweepYoung(HeapVisitor release) {
+  Arena *arena = heap.youngArenas;
+  while (arena != NULL) {
+    for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+      uint64_t young = loadBits(&arena->young[i]);
+      if (young == 0) {
+        continue;
+      }
+      uint64_t dead = young & ~loadBits(&arena->marked[i]);
+      setBits(&arena->old[i], young & ~dead);
+      clearBits(&arena->young[i], young);
+      while (dead != 0) {
+        release(cellAt(arena, i, __builtin_ctzll(dead)));
+        dead &= dead - 1;
+      }
+    }
+    Arena *next = arena->nextYoung;
+    arena->hasYoung = false;
+    arena->nextYoung = NULL;
+    arena = next;
+  }
+  heap.youngArenas = NULL;
+
+  LargeObject *object = heap.youngLarge;
+  while (object != NULL) {
+    LargeObject *next = object->next;
+    if (object->isMarked) {
+      pthread_mutex_lock(&heap.largeLock);
+      unlinkLarge(&heap.youngLarge, object);
+      object->isYoung = false;
+      linkLarge(&heap.oldLarge, object);
+      pthread_mutex_unlock(&heap.largeLock);
+    } else {
+      release(object + 1);
+    }
+    object = next;
+  }
+}
+
+void heapPromoteYoung() {
+  Arena *arena = heap.youngArenas;
+  while (arena != NULL) {
+    for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+      uint64_t young = loadBits(&arena->young[i]);
+      setBits(&arena->old[i], young);
+      clearBits(&arena->young[i], young);
+    }
+    Arena *next = arena->nextYoung;
+    arena->hasYoung = false;
+    arena->nextYoung = NULL;
+    arena = next;
+  }
+  heap.youngArenas = NULL;
+
+  pthread_mutex_lock(&heap.largeLock);
+  while (heap.youngLarge != NULL) {
+    LargeObject *object = heap.youngLarge;
+    unlinkLarge(&heap.youngLarge, object);
+    object->isYoung = false;
+    linkLarge(&heap.oldLarge, object);
+  }
+  pthread_mutex_unlock(&heap.largeLock);
+}
+
+// arenas created from here on only hold young cells, so the sweep stops
+// at the ones that exist now
+void heapStartSweep() {
+  heap.sweepArena = heap.arenas;
+  heap.sweepLarge = true;
+}
+
+bool heapSweep(int budget, HeapVisitor release) {
+  int freed = 0;
+  while (heap.sweepArena != NULL) {
+    Arena *arena = heap.sweepArena;
+    for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+      uint64_t dead =
+          loadBits(&arena->old[i]) & ~loadBits(&arena->marked[i]);
+      if (dead != 0) {
+        clearBits(&arena->old[i], dead);
+      }
+      while (dead != 0) {
+        release(cellAt(arena, i, __builtin_ctzll(dead)));
+        dead &= dead - 1;
+        freed++;
+      }
+    }
+    heap.sweepArena = arena->next;
+    if (budget > 0 && freed >= budget) {
+      return false;
+    }
+  }
+
+  if (heap.sweepLarge) {
+    // objects after the cursor stay put while it is unlocked, only the
+    // sweep frees old large objects
+    pthread_mutex_lock(&heap.largeLock);
+    LargeObject *object = heap.oldLarge;
+    while (object != NULL) {
+      LargeObject *next = object->next;
+      if (!object->isMarked) {
+        pthread_mutex_unlock(&heap.largeLock);
+        release(object + 1);
+        pthread_mutex_lock(&heap.largeLock);
+      }
+      object = next;
+    }
+    pthread_mutex_unlock(&heap.largeLock);
+    heap.sweepLarge = false;
+  }
+  return true;
+}
+
+void heapEachObject(HeapVisitor visit) {
+  for (Arena *arena = heap.arenas; arena != NULL; arena = arena->next) {
+    for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+      uint64_t live = arena->old[i] | arena->young[i];
+      while (live != 0) {
+        visit(cellAt(arena, i, __builtin_ctzll(live)));
+        live &= live - 1;
+      }
+    }
+  }
+
+  LargeObject *lists[] = {heap.youngLarge, heap.oldLarge};
+  for (int i = 0; i < 2; i++) {
+    LargeObject *object = lists[i];
+    while (object != NULL) {
+      LargeObject *next = object->next;
+      visit(object + 1);
+      object = next;
+    }
+  }
+}
+
+static int liveCells(Arena *arena) {
+  int count = 0;
+  for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+    count += __builtin_popcountll(arena->old[i] | arena->young[i]);
+  }
+  return count;
+}
+
+// the arena a size class bumps its new cells out of
+static bool isBumpArena(Arena *arena) {
+  uint8_t *limit = heap.limit[arena->sizeClass];
+  return limit != NULL && arenaOf(limit - 1) == arena;
+}
+
+bool heapPlanCompaction(bool everything) {
+  int chosen = 0;
+  for (Arena *arena = heap.arenas; arena != NULL; arena = arena->next) {
+    size_t capacity =
+        (HEAP_ARENA_SIZE - ARENA_HEADER) / cellSize(arena->sizeClass);
+    arena->evacuating =
+        everything || (!isBumpArena(arena) &&
+                       (size_t)liveCells(arena) * COMPACT_OCCUPANCY <=
+                           capacity);
+    if (arena->evacuating) {
+      chosen++;
+    }
+  }
+  if (chosen >= (everything ? 1 : COMPACT_MIN_ARENAS)) {
+    return true;
+  }
+  for (Arena *arena = heap.arenas; arena != NULL; arena = arena->next) {
+    arena->evacuating = false;
+  }
+  return false;
+}
+
+// takes the evacuated arenas out of the arena lists, and their cells out
+// of the free lists, so nothing is allocated in them
+static void detachEvacuated() {
+  Arena **link = &heap.arenas;
+  while (*link != NULL) {
+    Arena *arena = *link;
+    if (arena->evacuating && isBumpArena(arena)) {
+      heap.bump[arena->sizeClass] = NULL;
+      heap.limit[arena->sizeClass] = NULL;
+    }
+    if (arena->evacuating) {
+      *link = arena->next;
+      arena->next = heap.evacuated;
+      heap.evacuated = arena;
+    } else {
+      link = &arena->next;
+    }
+  }
+  link = &heap.youngArenas;
+  while (*link != NULL) {
+    if ((*link)->evacuating) {
+      *link = (*link)->nextYoung;
+    } else {
+      link = &(*link)->nextYoung;
+    }
+  }
+
+  for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+    Cell *head = NULL;
+    Cell *tail = NULL;
+    Cell *cell = heap.free.heads[i];
+    while (cell != NULL) {
+      UNPOISON(cell, sizeof(Cell));
+      Cell *next = cell->next;
+      if (!arenaOf(cell)->evacuating) {
+        if (tail == NULL) {
+          head = cell;
+        } else {
+          UNPOISON(tail, sizeof(Cell));
+          tail->next = cell;
+          POISON(tail, cellSize(i));
+        }
+        tail = cell;
+      }
+      POISON(cell, cellSize(i));
+      cell = next;
+    }
+    if (tail != NULL) {
+      UNPOISON(tail, sizeof(Cell));
+      tail->next = NULL;
+      POISON(tail, cellSize(i));
+    }
+    heap.free.heads[i] = head;
+    heap.free.tails[i] = tail;
+  }
+}
+
+// only runs while no other thread touches the heap, the bitmaps are
+// updated without atomics
+void heapEvacuate(HeapMover moved) {
+  detachEvacuated();
+  for (Arena *arena = heap.evacuated; arena != NULL; arena = arena->next) {
+    size_t bytes = cellSize(arena->sizeClass);
+    for (int i = 0; i < HEAP_BITMAP_WORDS; i++) {
+      uint64_t live = arena->old[i] | arena->young[i];
+      while (live != 0) {
+        uint64_t bit = live & -live;
+        void *from = cellAt(arena, i, __builtin_ctzll(live));
+        Cell *to = takeCell(arena->sizeClass);
+        memcpy(to, from, bytes);
+
+        Arena *target = arenaOf(to);
+        size_t granule = granuleOf(to);
+        uint64_t toBit = (uint64_t)1 << (granule % 64);
+        if (arena->old[i] & bit) {
+          target->old[granule / 64] |= toBit;
+        }
+        if (arena->young[i] & bit) {
+          target->young[granule / 64] |= toBit;
+          linkYoung(target);
+        }
+        if (arena->marked[i] & bit) {
+          target->marked[granule / 64] |= toBit;
+        }
+
+        moved(from, to);
+        ((void **)from)[1] = to;
+        live &= live - 1;
+      }
+    }
+  }
+}
+
+int heapReleaseEvacuated() {
+  int count = 0;
+  while (heap.evacuated != NULL) {
+    Arena *next = heap.evacuated->next;
+    UNPOISON(heap.evacuated, HEAP_ARENA_SIZE);
+    munmap(heap.evacuated, HEAP_ARENA_SIZE);
+    heap.evacuated = next;
+    count++;
+  }
+  return count;
+}
+
+// objects are freed one by one before this, arenas go all at once
+void freeHeap() {
+  Arena *arena = heap.arenas;
+  while (arena != NULL) {
+    Arena *next = arena->next;
+    UNPOISON(arena, HEAP_ARENA_SIZE);
+    munmap(arena, HEAP_ARENA_SIZE);
+    arena = next;
+  }
+  heap.arenas = NULL;
+  heap.youngArenas = NULL;
+  heap.sweepArena = NULL;
+  for (int i = 0; i < HEAP_CLASS_COUNT; i++) {
+    heap.bump[i] = NULL;
+    heap.limit[i] = NULL;
+  }
+  initFreeLists(&heap.free);
+}
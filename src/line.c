@@ -49,6 +49,18 @@ int getLine(LineArray *chunk, int offset) {
   return -1;
 }
 
+void truncateLineArray(LineArray *lineArray, int count) {
+  while (count > 0) {
+    Line *last = &lineArray->lines[lineArray->count - 1];
+    if (last->count > count) {
+      last->count -= count;
+      return;
+    }
+    count -= last->count;
+    lineArray->count--;
+  }
+}
+
 void freeLineArray(LineArray *lineArray) {
   FREE_ARRAY(Line, lineArray->lines, lineArray->capacity);
   initLineArray(lineArray);
@@ -1,11 +1,61 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "chunk.h"
 #include "common.h"
+#include "memory.h"
 #include "vm.h"
 
+static bool showCacheStats = false;
+static bool showGCPauses = false;
+static bool showGCStats = false;
+
+// a number of bytes, with an optional k, m or g suffix. 0 if malformed.
+static size_t parseSize(const char *text) {
+  char *end;
+  unsigned long long size = strtoull(text, &end, 10);
+  if (end == text) {
+    return 0;
+  }
+  switch (*end) {
+  case 'k':
+  case 'K':
+    size <<= 10;
+    end++;
+    break;
+  case 'm':
+  case 'M':
+    size <<= 20;
+    end++;
+    break;
+  case 'g':
+  case 'G':
+    size <<= 30;
+    end++;
+    break;
+  }
+  return *end == '\0' ? (size_t)size : 0;
+}
+
+// a growth factor has to let the heap grow
+static double parseGrowth(const char *text) {
+  char *end;
+  double growth = strtod(text, &end);
+  return end != text && *end == '\0' && growth > 1 ? growth : 0;
+}
+
+// a slice budget, where 0 means no slices. -1 if malformed.
+static int parseBudget(const char *text) {
+  char *end;
+  long budget = strtol(text, &end, 10);
+  if (end == text || *end != '\0' || budget < 0 || budget > INT_MAX) {
+    return -1;
+  }
+  return (int)budget;
+}
+
 static void repl() {
   char line[1024];
   for (;;) {
@@ -51,6 +101,18 @@ static void runFile(const char *path) {
   char *source = readFile(path);
   InterpretResult result = interpret(source);
   free(source);
+  if (showCacheStats) {
+    printInlineCacheStats();
+  }
+  if (showGCPauses) {
+    printGCPauses();
+  }
+  if (vm.gcLogCycles) {
+    flushGCStats();
+  }
+  if (showGCStats) {
+    printGCStats();
+  }
 
   if (result == INTERPRET_COMPILE_ERROR)
     exit(65);
@@ -61,13 +123,93 @@ static void runFile(const char *path) {
 int main(int argc, const char *argv[]) {
   initVM();
 
-  if (argc == 1) {
+  const char *threads = getenv("CLOX_GC_THREADS");
+  if (threads != NULL && atoi(threads) > 0) {
+    vm.gcThreads = atoi(threads);
+  }
+
+  const char *sweep = getenv("CLOX_GC_SWEEP");
+  if (sweep != NULL && strcmp(sweep, "background") == 0) {
+    vm.gcBackgroundSweep = true;
+  }
+
+  const char *compact = getenv("CLOX_GC_COMPACT");
+  if (compact != NULL && strcmp(compact, "off") == 0) {
+    vm.gcCompact = false;
+  }
+
+  const char *initialHeap = getenv("CLOX_GC_INITIAL_HEAP");
+  if (initialHeap != NULL && parseSize(initialHeap) > 0) {
+    vm.gcInitialHeap = parseSize(initialHeap);
+  }
+
+  const char *growth = getenv("CLOX_GC_GROWTH");
+  if (growth != NULL && parseGrowth(growth) > 0) {
+    vm.gcGrowth = parseGrowth(growth);
+  }
+
+  const char *maxHeap = getenv("CLOX_GC_MAX_HEAP");
+  if (maxHeap != NULL && parseSize(maxHeap) > 0) {
+    vm.gcMaxHeap = parseSize(maxHeap);
+  }
+
+  const char *path = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--cache-stats") == 0) {
+      showCacheStats = true;
+    } else if (strcmp(argv[i], "--gc-pauses") == 0) {
+      showGCPauses = true;
+    } else if (strcmp(argv[i], "--gc-stats") == 0) {
+      showGCStats = true;
+    } else if (strcmp(argv[i], "--gc-stats=json") == 0) {
+      showGCStats = true;
+      vm.gcLogCycles = true;
+    } else if (strncmp(argv[i], "--gc-budget=", 12) == 0 &&
+               parseBudget(argv[i] + 12) >= 0) {
+      vm.gcBudget = parseBudget(argv[i] + 12);
+    } else if (strncmp(argv[i], "--gc-threads=", 13) == 0 &&
+               atoi(argv[i] + 13) > 0) {
+      vm.gcThreads = atoi(argv[i] + 13);
+    } else if (strcmp(argv[i], "--gc-sweep=lazy") == 0) {
+      vm.gcBackgroundSweep = false;
+    } else if (strcmp(argv[i], "--gc-sweep=background") == 0) {
+      vm.gcBackgroundSweep = true;
+    } else if (strcmp(argv[i], "--gc-compact=on") == 0) {
+      vm.gcCompact = true;
+    } else if (strcmp(argv[i], "--gc-compact=off") == 0) {
+      vm.gcCompact = false;
+    } else if (strncmp(argv[i], "--gc-initial-heap=", 18) == 0 &&
+               parseSize(argv[i] + 18) > 0) {
+      vm.gcInitialHeap = parseSize(argv[i] + 18);
+    } else if (strncmp(argv[i], "--gc-growth=", 12) == 0 &&
+               parseGrowth(argv[i] + 12) > 0) {
+      vm.gcGrowth = parseGrowth(argv[i] + 12);
+    } else if (strncmp(argv[i], "--gc-max-heap=", 14) == 0 &&
+               parseSize(argv[i] + 14) > 0) {
+      vm.gcMaxHeap = parseSize(argv[i] + 14);
+    } else if (strcmp(argv[i], "-O0") == 0) {
+      vm.optLevel = 0;
+    } else if (strcmp(argv[i], "-O1") == 0) {
+      vm.optLevel = 1;
+    } else if (path == NULL && argv[i][0] != '-') {
+      path = argv[i];
+    } else {
+      fprintf(stderr, "Usage: clox [-O0|-O1] [--cache-stats] [--gc-pauses] "
+                      "[--gc-stats[=json]] "
+                      "[--gc-budget=<objects>] [--gc-threads=<count>] "
+                      "[--gc-sweep=lazy|background] "
+                      "[--gc-compact=on|off] [--gc-initial-heap=<size>] "
+                      "[--gc-growth=<factor>] [--gc-max-heap=<size>] "
+                      "[path]\n");
+      exit(64);
+    }
+  }
+  vm.nextGC = vm.gcInitialHeap;
+
+  if (path == NULL) {
     repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+    runFile(path);
   }
 
   freeVM();
@@ -1,29 +1,85 @@
 #include "memory.h"
 #include "compiler.h"
+#include "heap.h"
 #include "object.h"
 #include "table.h"
 #include "vm.h"
 
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #ifdef DEBUG_LOG_GC
 #include "debug.h"
-#include <stdio.h>
 #endif
 
-#define GC_HEAP_GROW_FACTOR 2
+// bytes allocated between two minor collections
+#define GC_NURSERY_SIZE (2 * 1024 * 1024)
+// bytes allocated between two slices of a full collection
+#define GC_SLICE_SIZE (64 * 1024)
+
+static void collectYoung();
+static void collectStep();
+static void checkHeapLimit();
+
+// a GC thread marking in parallel with the others. each one owns a gray
+// deque, pops from its top and steals from the bottom of the others.
+typedef struct {
+  pthread_t thread;
+  int index;
+  pthread_mutex_t lock;
+  Obj **gray;
+  int bottom;
+  int top;
+  int capacity;
+  // most gray objects in the deque at once this cycle
+  int highWater;
+} Marker;
+
+static Marker *markers = NULL;
+static int markerCount = 0;
+// the marker of the current thread while marking in parallel
+static __thread Marker *currentMarker = NULL;
+
+// the background sweeper frees the dead old objects of the last full
+// collection while the program runs, into free lists of its own
+static pthread_t sweeper;
+static size_t sweeperFreed;
+static uint32_t sweeperObjects[OBJ_TYPE_COUNT];
+static uint64_t sweeperTime;
+static FreeLists sweeperCells;
+static bool sweeperDone;
+static __thread bool isSweeper = false;
+
+// the cycle that the objects the main thread frees count towards, while
+// it sweeps
+static GCCycle *sweeping = NULL;
+// most objects on the gray stack at once this cycle
+static int grayHighWater = 0;
 
 void *reallocate(void *pointer, size_t oldSize, size_t newSize,
                  bool triggerGC) {
+  if (isSweeper) {
+    // the sweeper only frees, and counts on its own until it is joined
+    sweeperFreed += oldSize;
+    free(pointer);
+    return NULL;
+  }
+
   vm.bytesAllocated += newSize - oldSize;
+  if (newSize < oldSize && sweeping != NULL) {
+    sweeping->bytesFreed += oldSize - newSize;
+  }
+  if (newSize > oldSize) {
+    vm.nurseryBytes += newSize - oldSize;
+    vm.sliceBytes += newSize - oldSize;
+  }
   if (newSize > oldSize && triggerGC) {
-#ifdef DEBUG_STRESS_GC
-    collectGarbage();
-#endif
-
-    if (vm.bytesAllocated > vm.nextGC && triggerGC) {
-      collectGarbage();
-    }
+    collectStep();
+    checkHeapLimit();
   }
 
   if (newSize == 0) {
@@ -32,62 +88,139 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize,
   }
 
   void *result = realloc(pointer, newSize);
-  if (result == NULL)
+  if (result == NULL && triggerGC) {
+    collectGarbage();
+    result = realloc(pointer, newSize);
+  }
+  if (result == NULL) {
+    fprintf(stderr, "Out of memory.\n");
     exit(1);
+  }
   return result;
 }
 
+void *allocateHeapObject(size_t size) {
+  vm.bytesAllocated += size;
+  vm.nurseryBytes += size;
+  vm.sliceBytes += size;
+  collectStep();
+  checkHeapLimit();
+  return heapAllocate(size);
+}
+
+void freeHeapObject(void *object, size_t size) {
+  if (isSweeper) {
+    sweeperFreed += size;
+    sweeperObjects[((Obj *)object)->type]++;
+    heapFreeTo(&sweeperCells, object, size);
+    return;
+  }
+  vm.bytesAllocated -= size;
+  if (sweeping != NULL) {
+    sweeping->bytesFreed += size;
+    sweeping->freed[((Obj *)object)->type]++;
+  }
+  heapFree(object, size);
+}
+
 static void freeObject(Obj *object) {
 #ifdef DEBUG_LOG_GC
   printf("%p free type %d\n", (void *)object, object->type);
 #endif
   switch (object->type) {
   case OBJ_BOUND_METHOD:
-    FREE(ObjBoundMethod, object);
+    FREE_OBJ(ObjBoundMethod, object);
     break;
   case OBJ_INSTANCE: {
     ObjInstance *instance = (ObjInstance *)object;
-    freeTable(&instance->fields);
-    FREE(ObjInstance, object);
+    if (instance->fields != instance->inlineFields) {
+      FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+    }
+    freeTable(&instance->dictionary);
+    freeHeapObject(object, sizeof(ObjInstance) +
+                               sizeof(Value) * instance->inlineCount);
+    break;
+  }
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    FREE_ARRAY(ObjString *, shape->names, shape->fieldCount);
+    freeTable(&shape->slots);
+    freeTable(&shape->transitions);
+    FREE_OBJ(ObjShape, object);
     break;
   }
   case OBJ_CLASS: {
     ObjClass *klass = (ObjClass *)object;
     freeTable(&klass->methods);
-    FREE(ObjClass, object);
+    FREE_OBJ(ObjClass, object);
     break;
   }
   case OBJ_STRING: {
     ObjString *string = (ObjString *)object;
-    FREE(ObjString, object);
+    freeHeapObject(object, sizeof(ObjString) + string->length + 1);
+    break;
+  }
+  case OBJ_ROPE: {
+    FREE_OBJ(ObjRope, object);
     break;
   }
   case OBJ_FUNCTION: {
     ObjFunction *function = (ObjFunction *)object;
     freeChunk(&function->chunk);
-    FREE(ObjFunction, object);
+    FREE_OBJ(ObjFunction, object);
     break;
   }
   case OBJ_CLOSURE: {
-    FREE(ObjClosure, object);
+    FREE_OBJ(ObjClosure, object);
     break;
   }
   case OBJ_NATIVE: {
-    FREE(ObjNative, object);
+    FREE_OBJ(ObjNative, object);
     break;
   }
   case OBJ_UPVALUE: {
-    FREE(ObjUpvalue, object);
+    FREE_OBJ(ObjUpvalue, object);
     break;
   }
   }
 }
 
+static void pushGray(Marker *marker, Obj *object) {
+  pthread_mutex_lock(&marker->lock);
+  if (marker->top == marker->capacity) {
+    if (marker->bottom > 0) {
+      memmove(marker->gray, marker->gray + marker->bottom,
+              sizeof(Obj *) * (marker->top - marker->bottom));
+      marker->top -= marker->bottom;
+      marker->bottom = 0;
+    } else {
+      marker->capacity = GROW_CAPACITY(marker->capacity);
+      marker->gray =
+          (Obj **)realloc(marker->gray, sizeof(Obj *) * marker->capacity);
+      if (marker->gray == NULL)
+        exit(1);
+    }
+  }
+  marker->gray[marker->top++] = object;
+  if (marker->top - marker->bottom > marker->highWater) {
+    marker->highWater = marker->top - marker->bottom;
+  }
+  pthread_mutex_unlock(&marker->lock);
+}
+
 void markObject(Obj *object) {
   if (object == NULL) {
     return;
   }
-  if (object->isMarked) {
+  bool large = object->flags & OBJ_LARGE;
+  if (currentMarker != NULL) {
+    // another marker may be marking it at the same time
+    if (heapMark(object, large)) {
+      pushGray(currentMarker, object);
+    }
+    return;
+  }
+  if (!heapMark(object, large)) {
     return;
   }
 
@@ -97,8 +230,6 @@ void markObject(Obj *object) {
   printf("\n");
 #endif
 
-  object->isMarked = true;
-
   if (vm.grayCapacity < vm.grayCount + 1) {
     vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
     vm.grayStack =
@@ -108,6 +239,29 @@ void markObject(Obj *object) {
   }
 
   vm.grayStack[vm.grayCount++] = object;
+  if (vm.grayCount > grayHighWater) {
+    grayHighWater = vm.grayCount;
+  }
+}
+
+void rememberObject(Obj *object) {
+  if (vm.rememberedCapacity < vm.rememberedCount + 1) {
+    vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+    vm.remembered = (Obj **)realloc(vm.remembered,
+                                    sizeof(Obj *) * vm.rememberedCapacity);
+    if (vm.remembered == NULL)
+      exit(1);
+  }
+
+  object->flags |= OBJ_REMEMBERED;
+  vm.remembered[vm.rememberedCount++] = object;
+}
+
+static void clearRemembered() {
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    vm.remembered[i]->flags &= ~OBJ_REMEMBERED;
+  }
+  vm.rememberedCount = 0;
 }
 
 void markValue(Value value) {
@@ -121,6 +275,18 @@ static void markArray(ValueArray *array) {
   }
 }
 
+static void markCaches(Chunk *chunk) {
+  for (uint32_t i = 0; i < chunk->cacheCount; i++) {
+    InlineCache *cache = &chunk->caches[i];
+    markObject((Obj *)cache->name);
+    for (int j = 0; j < cache->count; j++) {
+      markObject((Obj *)cache->entries[j].shape);
+      markObject((Obj *)cache->entries[j].transition);
+      markObject((Obj *)cache->entries[j].method);
+    }
+  }
+}
+
 static void blackenObject(Obj *object) {
 #ifdef DEBUG_LOG_GC
   printf("%p blacken ", (void *)object);
@@ -137,13 +303,28 @@ static void blackenObject(Obj *object) {
   case OBJ_INSTANCE: {
     ObjInstance *instance = (ObjInstance *)object;
     markObject((Obj *)instance->klass);
-    markTable(&instance->fields);
+    markObject((Obj *)instance->shape);
+    if (instance->shape != NULL) {
+      for (int i = 0; i < instance->shape->fieldCount; i++) {
+        markValue(instance->fields[i]);
+      }
+    }
+    markTable(&instance->dictionary);
+    break;
+  }
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    for (int i = 0; i < shape->fieldCount; i++) {
+      markObject((Obj *)shape->names[i]);
+    }
+    markTable(&shape->transitions);
     break;
   }
   case OBJ_CLASS: {
     ObjClass *klass = (ObjClass *)object;
     markTable(&klass->methods);
     markObject((Obj *)klass->name);
+    markObject((Obj *)klass->rootShape);
     break;
   }
   case OBJ_CLOSURE: {
@@ -158,23 +339,51 @@ static void blackenObject(Obj *object) {
     ObjFunction *function = (ObjFunction *)object;
     markObject((Obj *)function->name);
     markArray(&function->chunk.constants);
+    markCaches(&function->chunk);
     break;
   }
   case OBJ_UPVALUE:
     markValue(((ObjUpvalue *)object)->closed);
     break;
+  case OBJ_ROPE: {
+    ObjRope *rope = (ObjRope *)object;
+    markObject(rope->left);
+    markObject(rope->right);
+    markObject((Obj *)rope->flat);
+    break;
+  }
   case OBJ_NATIVE:
   case OBJ_STRING:
     break;
   }
 }
 
-static void markRoots() {
-  // objects on the stack
-  for (int i = 0; i < vm.stack.top; i++) {
+// marks the index-th of count equal parts of the stack and of the global
+// variables, the roots that can be large
+static void markRootPart(int index, int count) {
+  int stackCount = (int)(vm.stack.top - vm.stack.items);
+  for (int i = stackCount * index / count;
+       i < stackCount * (index + 1) / count; i++) {
     markValue(vm.stack.items[i]);
   }
 
+  int globalCount = vm.globalValues.count;
+  for (int i = globalCount * index / count;
+       i < globalCount * (index + 1) / count; i++) {
+    markValue(vm.globalValues.values[i]);
+  }
+}
+
+// set when the markers still have to mark their parts of the roots
+static bool rootPartsPending = false;
+
+static void markRoots() {
+  if (vm.gcThreads > 1) {
+    rootPartsPending = true;
+  } else {
+    markRootPart(0, 1);
+  }
+
   for (int i = 0; i < vm.frameCount; i++) {
     markObject((Obj *)vm.frames[i].closure);
   }
@@ -184,65 +393,805 @@ static void markRoots() {
     markObject((Obj *)upvalue);
   }
 
-  markTable(&vm.globals);
+  markTable(&vm.globalSlots);
+  markArray(&vm.globalNames);
   markCompilerRoots();
   markObject((Obj *)vm.initString);
+  markObject((Obj *)vm.gcStatsClass);
+  markObject((Obj *)vm.gcFreedClass);
+}
+
+static Obj *popGray(Marker *marker) {
+  Obj *object = NULL;
+  pthread_mutex_lock(&marker->lock);
+  if (marker->top > marker->bottom) {
+    object = marker->gray[--marker->top];
+  }
+  pthread_mutex_unlock(&marker->lock);
+  return object;
+}
+
+static int grayCount(Marker *marker) {
+  pthread_mutex_lock(&marker->lock);
+  int count = marker->top - marker->bottom;
+  pthread_mutex_unlock(&marker->lock);
+  return count;
+}
+
+// moves the older half of another marker's gray objects to this one
+static bool stealGray(Marker *thief) {
+  for (int i = 1; i < markerCount; i++) {
+    Marker *victim = &markers[(thief->index + i) % markerCount];
+    if (grayCount(victim) == 0) {
+      continue;
+    }
+
+    Obj *stolen[256];
+    int count = 0;
+    pthread_mutex_lock(&victim->lock);
+    int half = (victim->top - victim->bottom + 1) / 2;
+    while (count < half && count < 256) {
+      stolen[count++] = victim->gray[victim->bottom++];
+    }
+    pthread_mutex_unlock(&victim->lock);
+
+    for (int j = 0; j < count; j++) {
+      pushGray(thief, stolen[j]);
+    }
+    if (count > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool anyGray() {
+  for (int i = 0; i < markerCount; i++) {
+    if (grayCount(&markers[i]) > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolStart = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t poolDone = PTHREAD_COND_INITIALIZER;
+static uint64_t poolRound = 0;
+static int poolRunning = 0;
+static bool poolExit = false;
+// objects each marker blackens in the current round, 0 for no limit
+static int markerBudget = 0;
+// markers that ran out of work or budget
+static int idleMarkers = 0;
+
+// blackens gray objects until every marker is out of work, or until this
+// one has used its budget
+static void runMarker(Marker *self) {
+  currentMarker = self;
+  if (rootPartsPending) {
+    markRootPart(self->index, markerCount);
+  }
+
+  int blackened = 0;
+  for (;;) {
+    Obj *object;
+    while ((object = popGray(self)) != NULL) {
+      blackenObject(object);
+      if (markerBudget > 0 && ++blackened == markerBudget) {
+        __atomic_add_fetch(&idleMarkers, 1, __ATOMIC_SEQ_CST);
+        currentMarker = NULL;
+        return;
+      }
+    }
+    if (stealGray(self)) {
+      continue;
+    }
+
+    // all the gray objects are in the deques, and only busy markers push
+    // to them, so once every marker is idle the work is done
+    __atomic_add_fetch(&idleMarkers, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+      if (__atomic_load_n(&idleMarkers, __ATOMIC_SEQ_CST) == markerCount) {
+        currentMarker = NULL;
+        return;
+      }
+      if (anyGray()) {
+        __atomic_sub_fetch(&idleMarkers, 1, __ATOMIC_SEQ_CST);
+        break;
+      }
+      sched_yield();
+    }
+  }
+}
+
+static void *markerThread(void *arg) {
+  Marker *self = (Marker *)arg;
+  uint64_t round = 0;
+  for (;;) {
+    pthread_mutex_lock(&poolLock);
+    while (poolRound == round && !poolExit) {
+      pthread_cond_wait(&poolStart, &poolLock);
+    }
+    if (poolExit) {
+      pthread_mutex_unlock(&poolLock);
+      return NULL;
+    }
+    round = poolRound;
+    pthread_mutex_unlock(&poolLock);
+
+    runMarker(self);
+
+    pthread_mutex_lock(&poolLock);
+    if (--poolRunning == 0) {
+      pthread_cond_signal(&poolDone);
+    }
+    pthread_mutex_unlock(&poolLock);
+  }
+}
+
+// the main thread is the first marker, the others are started once
+static void startMarkers() {
+  markerCount = vm.gcThreads;
+  markers = (Marker *)calloc(markerCount, sizeof(Marker));
+  if (markers == NULL)
+    exit(1);
+  for (int i = 0; i < markerCount; i++) {
+    markers[i].index = i;
+    pthread_mutex_init(&markers[i].lock, NULL);
+    if (i > 0 &&
+        pthread_create(&markers[i].thread, NULL, markerThread, &markers[i])) {
+      exit(1);
+    }
+  }
+}
+
+static void stopMarkers() {
+  pthread_mutex_lock(&poolLock);
+  poolExit = true;
+  pthread_cond_broadcast(&poolStart);
+  pthread_mutex_unlock(&poolLock);
+  for (int i = 0; i < markerCount; i++) {
+    if (i > 0) {
+      pthread_join(markers[i].thread, NULL);
+    }
+    pthread_mutex_destroy(&markers[i].lock);
+    free(markers[i].gray);
+  }
+  free(markers);
+  markers = NULL;
+  markerCount = 0;
+}
+
+// deals the gray stack out to the markers, runs them, and collects the
+// gray objects they leave once they run out of budget
+static void traceParallel(int budget) {
+  if (markers == NULL) {
+    startMarkers();
+  }
+  for (int i = 0; i < vm.grayCount; i++) {
+    pushGray(&markers[i % markerCount], vm.grayStack[i]);
+  }
+  vm.grayCount = 0;
+  markerBudget = budget == 0 ? 0 : (budget + markerCount - 1) / markerCount;
+  idleMarkers = 0;
+  heapSharing++;
+
+  pthread_mutex_lock(&poolLock);
+  poolRunning = markerCount - 1;
+  poolRound++;
+  pthread_cond_broadcast(&poolStart);
+  pthread_mutex_unlock(&poolLock);
+
+  runMarker(&markers[0]);
+
+  pthread_mutex_lock(&poolLock);
+  while (poolRunning > 0) {
+    pthread_cond_wait(&poolDone, &poolLock);
+  }
+  pthread_mutex_unlock(&poolLock);
+  heapSharing--;
+  rootPartsPending = false;
+
+  for (int i = 0; i < markerCount; i++) {
+    Marker *marker = &markers[i];
+    for (int j = marker->bottom; j < marker->top; j++) {
+      if (vm.grayCapacity < vm.grayCount + 1) {
+        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+        vm.grayStack =
+            (Obj **)realloc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity);
+        if (vm.grayStack == NULL)
+          exit(1);
+      }
+      vm.grayStack[vm.grayCount++] = marker->gray[j];
+    }
+    marker->bottom = 0;
+    marker->top = 0;
+  }
 }
 
-static void traceReferences() {
-  while (vm.grayCount > 0) {
+// blackens up to budget gray objects, or all of them if budget is 0
+static void traceReferences(int budget) {
+  if (vm.gcThreads > 1) {
+    traceParallel(budget);
+    return;
+  }
+
+  for (int i = 0; vm.grayCount > 0 && (budget == 0 || i < budget); i++) {
     Obj *object = vm.grayStack[--vm.grayCount];
     blackenObject(object);
   }
 }
 
-static void sweep() {
-  Obj *previous = NULL;
-  Obj *object = vm.objects;
-  while (object != NULL) {
-    if (object->isMarked) {
-      object->isMarked = false;
-      previous = object;
-      object = object->next;
-    } else {
-      Obj *unreached = object;
-      object = object->next;
-      if (previous != NULL) {
-        previous->next = object;
-      } else {
-        vm.objects = object;
-      }
+uint64_t gcClock() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void beginCycle(GCCycle *cycle, bool full) {
+  memset(cycle, 0, sizeof(GCCycle));
+  cycle->full = full;
+  cycle->start = gcClock() - vm.startTime;
+  cycle->bytesBefore = vm.bytesAllocated;
+  grayHighWater = 0;
+  for (int i = 0; i < markerCount; i++) {
+    markers[i].highWater = 0;
+  }
+}
 
-      freeObject(unreached);
+static int grayMax() {
+  int max = grayHighWater;
+  for (int i = 0; i < markerCount; i++) {
+    if (markers[i].highWater > max) {
+      max = markers[i].highWater;
     }
   }
+  return max;
 }
 
-void freeObjects() {
-  Obj *object = vm.objects;
-  while (object != NULL) {
-    Obj *next = object->next;
-    freeObject(object);
-    object = next;
+static void endCycle(GCCycle *cycle) {
+  GCStats *stats = &vm.gcStats;
+  if (cycle->full) {
+    stats->fullCycles++;
+  } else {
+    stats->minorCycles++;
+  }
+  stats->markTime += cycle->markTime;
+  stats->sweepTime += cycle->sweepTime;
+  stats->bytesFreed += cycle->bytesFreed;
+  if (cycle->grayMax > stats->grayMax) {
+    stats->grayMax = cycle->grayMax;
+  }
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    stats->freed[i] += cycle->freed[i];
   }
+  if (vm.gcLogCycles) {
+    printGCCycle(cycle);
+  }
+}
+
+// a full cycle is only added up once the pause its sweep ended in is
+// over, so that pause counts towards it
+static bool fullCycleOpen = false;
+
+static void closeFullCycle() {
+  if (fullCycleOpen && vm.gcPhase == GC_IDLE) {
+    fullCycleOpen = false;
+    endCycle(&vm.fullCycle);
+  }
+}
+
+static void endCollection() {
+  vm.gcPhase = GC_IDLE;
+  vm.fullCycle.end = gcClock() - vm.startTime;
+  vm.fullCycle.bytesAfter = vm.bytesAllocated;
+  // the sweep may have left the arenas fragmented, the interpreter checks
+  // at its next safe point
+  vm.compactPending = vm.gcCompact;
+  vm.nextGC = (size_t)(vm.bytesAllocated * vm.gcGrowth);
+  if (vm.nextGC < vm.gcInitialHeap) {
+    vm.nextGC = vm.gcInitialHeap;
+  }
+  // leave room under the limit for what the program allocates while the
+  // next collection runs
+  if (vm.gcMaxHeap > 0 && vm.nextGC > vm.gcMaxHeap / 2) {
+    vm.nextGC = vm.gcMaxHeap / 2;
+  }
+#ifdef DEBUG_LOG_GC
+  printf("-- gc end, next at %zu\n", vm.nextGC);
+#endif
+}
+
+static void freeVisited(void *object) { freeObject((Obj *)object); }
+
+static void *sweeperThread(void *arg) {
+  (void)arg;
+  isSweeper = true;
+  uint64_t start = gcClock();
+  heapSweep(0, freeVisited);
+  sweeperTime = gcClock() - start;
+  __atomic_store_n(&sweeperDone, true, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// the program only reads the bits of live objects and never touches dead
+// ones, so the sweeper can free them alongside it
+static void startSweeper() {
+  sweeperFreed = 0;
+  memset(sweeperObjects, 0, sizeof(sweeperObjects));
+  initFreeLists(&sweeperCells);
+  sweeperDone = false;
+  heapSharing++;
+  if (pthread_create(&sweeper, NULL, sweeperThread, NULL)) {
+    exit(1);
+  }
+}
+
+static void joinSweeper() {
+  pthread_join(sweeper, NULL);
+  heapSharing--;
+  vm.bytesAllocated -= sweeperFreed;
+  vm.fullCycle.bytesFreed += sweeperFreed;
+  vm.fullCycle.sweepTime += sweeperTime;
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    vm.fullCycle.freed[i] += sweeperObjects[i];
+  }
+  heapReclaim(&sweeperCells);
+  endCollection();
+}
+
+// sweeps up to budget old objects on this thread, or all of them if
+// budget is 0
+static void sweepOld(int budget) {
+  uint64_t start = gcClock();
+  sweeping = &vm.fullCycle;
+  bool done = heapSweep(budget, freeVisited);
+  sweeping = NULL;
+  vm.fullCycle.sweepTime += gcClock() - start;
+  if (done) {
+    endCollection();
+  }
+}
+
+// sweeps a slice of the old objects. the background sweeper is only
+// checked on, never waited for.
+static void sweepSlice(int budget) {
+  if (!vm.gcBackgroundSweep) {
+    sweepOld(budget);
+  } else if (__atomic_load_n(&sweeperDone, __ATOMIC_ACQUIRE)) {
+    joinSweeper();
+  }
+}
+
+void finishSweeping() {
+  if (vm.gcPhase != GC_SWEEP) {
+    return;
+  }
+  if (vm.gcBackgroundSweep) {
+    joinSweeper();
+  } else {
+    sweepOld(0);
+  }
+}
+
+void flushGCStats() {
+  finishSweeping();
+  closeFullCycle();
+}
+
+// frees the unmarked young objects and promotes the rest
+static void sweepYoung(GCCycle *cycle) {
+  sweeping = cycle;
+  heapSweepYoung(freeVisited);
+  sweeping = NULL;
+  vm.nurseryBytes = 0;
+}
+
+void freeObjects() {
+  finishSweeping();
+  heapEachObject(freeVisited);
+  freeHeap();
   free(vm.grayStack);
+  free(vm.remembered);
+  if (markers != NULL) {
+    stopMarkers();
+  }
 }
 
-void collectGarbage() {
+// counts a pause, towards cycle too unless it is NULL
+static void pauseEnd(uint64_t start, GCCycle *cycle) {
+  uint64_t pause = gcClock() - start;
+  vm.pauseCount++;
+  vm.pauseTotal += pause;
+  if (pause > vm.pauseMax) {
+    vm.pauseMax = pause;
+  }
+  if (cycle != NULL) {
+    cycle->pauses++;
+    if (pause > cycle->pauseMax) {
+      cycle->pauseMax = pause;
+    }
+  }
+}
+
+// collects only the objects allocated since the last collection. old
+// objects are already marked, so tracing stops at them, and the young
+// objects they point to are found through the remembered set.
+static void collectYoung() {
+#ifdef DEBUG_LOG_GC
   size_t before = vm.bytesAllocated;
+  printf("-- minor gc begin\n");
+#endif
+  GCCycle cycle;
+  beginCycle(&cycle, false);
+  uint64_t start = gcClock();
+  markRoots();
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    blackenObject(vm.remembered[i]);
+  }
+  traceReferences(0);
+  clearRemembered();
+  tableRemoveWhite(&vm.strings);
+  uint64_t marked = gcClock();
+  sweepYoung(&cycle);
+  uint64_t end = gcClock();
+
+  cycle.end = end - vm.startTime;
+  cycle.markTime = marked - start;
+  cycle.sweepTime = end - marked;
+  cycle.pauses = 1;
+  cycle.pauseMax = end - start;
+  cycle.bytesAfter = vm.bytesAllocated;
+  cycle.grayMax = grayMax();
+  endCycle(&cycle);
+
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu)\n",
+         before - vm.bytesAllocated, before, vm.bytesAllocated);
+#endif
+}
+
+// starts a full collection by unmarking every object and graying the roots
+static void startMarking() {
 #ifdef DEBUG_LOG_GC
   printf("-- gc begin\n");
 #endif
+  closeFullCycle();
+  beginCycle(&vm.fullCycle, true);
+  fullCycleOpen = true;
+  uint64_t start = gcClock();
+  heapClearMarks();
+  clearRemembered();
+  vm.gcPhase = GC_MARK;
   markRoots();
-  traceReferences();
+  vm.fullCycle.markTime += gcClock() - start;
+}
+
+// the program has changed the roots and the remembered objects since they
+// were traced, and objects allocated while marking are still unmarked.
+// trace those again, then drop the dead objects.
+static void finishMarking() {
+  uint64_t start = gcClock();
+  traceReferences(0);
+  markRoots();
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    blackenObject(vm.remembered[i]);
+  }
+  traceReferences(0);
+  // dead objects may still be in the set, drop it before sweeping
+  clearRemembered();
   tableRemoveWhite(&vm.strings);
-  sweep();
 
-  vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+  // the unmarked young objects are swept along with the old ones
+  heapPromoteYoung();
+  vm.nurseryBytes = 0;
+  heapStartSweep();
+  vm.gcPhase = GC_SWEEP;
+  vm.fullCycle.markTime += gcClock() - start;
+  vm.fullCycle.grayMax = grayMax();
+  if (vm.gcBackgroundSweep) {
+    startSweeper();
+  }
+}
+
+static void markSlice(int budget) {
+  uint64_t start = gcClock();
+  traceReferences(budget);
+  vm.fullCycle.markTime += gcClock() - start;
+  if (vm.grayCount == 0) {
+    finishMarking();
+  }
+}
+
+#ifdef DEBUG_STRESS_GC
+// does some collection work on every allocation, in slices small enough
+// that full collections interleave with the program as much as possible
+static void stressStep() {
+  static bool stressFull = false;
+  switch (vm.gcPhase) {
+  case GC_IDLE:
+    stressFull = !stressFull;
+    if (stressFull) {
+      startMarking();
+    } else {
+      collectYoung();
+    }
+    break;
+  case GC_MARK:
+    markSlice(4);
+    break;
+  case GC_SWEEP:
+    collectYoung();
+    sweepSlice(4);
+    break;
+  }
+}
+#endif
+
+// runs whatever collection work is due after an allocation. a full
+// collection starts once the nursery is full and the rest of the heap
+// (mostly promoted objects) has outgrown its threshold. it then marks and
+// sweeps in slices of vm.gcBudget objects, one for every GC_SLICE_SIZE
+// bytes allocated, or leaves sweeping to the background sweeper. minor
+// collections wait until marking is done.
+static void collectStep() {
+#ifdef DEBUG_STRESS_GC
+  stressStep();
+#endif
+
+  if (vm.gcPhase != GC_IDLE && vm.sliceBytes > GC_SLICE_SIZE) {
+    uint64_t start = gcClock();
+    if (vm.gcPhase == GC_MARK) {
+      markSlice(vm.gcBudget);
+    } else {
+      sweepSlice(vm.gcBudget);
+    }
+    vm.sliceBytes = 0;
+    pauseEnd(start, &vm.fullCycle);
+    closeFullCycle();
+  }
+  if (vm.gcPhase == GC_MARK || vm.nurseryBytes <= GC_NURSERY_SIZE) {
+    return;
+  }
+
+  uint64_t start = gcClock();
+  if (vm.gcPhase == GC_IDLE &&
+      vm.bytesAllocated > vm.nextGC + vm.nurseryBytes) {
+    startMarking();
+    markSlice(vm.gcBudget);
+    if (vm.gcBudget == 0) {
+      sweepSlice(0);
+    }
+    vm.sliceBytes = 0;
+    pauseEnd(start, &vm.fullCycle);
+    closeFullCycle();
+  } else {
+    // a minor collection counts its own pause
+    collectYoung();
+    pauseEnd(start, NULL);
+  }
+}
+
+// runs a whole full collection, finishing the one under way if any
+void collectGarbage() {
+  uint64_t start = gcClock();
+  size_t before = vm.bytesAllocated;
+  finishSweeping();
+  if (vm.gcPhase == GC_IDLE) {
+    startMarking();
+  }
+  finishMarking();
+  finishSweeping();
+
+#ifdef DEBUG_LOG_GC
+  printf("   collected %zu bytes (from %zu to %zu)\n",
+         before - vm.bytesAllocated, before, vm.bytesAllocated);
+#endif
+  pauseEnd(start, &vm.fullCycle);
+  closeFullCycle();
+}
+
+// the new address of an object moved by the compaction under way
+static Obj *forward(Obj *object) {
+  if (object == NULL) {
+    return NULL;
+  }
+  return (Obj *)heapForward(object, object->flags & OBJ_LARGE);
+}
+
+#define FORWARD(pointer) ((pointer) = (void *)forward((Obj *)(pointer)))
+
+static void forwardValue(Value *value) {
+  if (IS_OBJ(*value)) {
+    *value = OBJ_VAL(forward(AS_OBJ(*value)));
+  }
+}
+
+static void forwardArray(ValueArray *array) {
+  for (int i = 0; i < array->count; i++) {
+    forwardValue(&array->values[i]);
+  }
+}
+
+// keys keep their hashes, so the entries stay where they are
+static void forwardTable(Table *table) {
+  ObjString **keys = tableKeys(table);
+  Value *values = tableValues(table);
+  for (int i = 0; i < table->capacity; i++) {
+    if (keys[i] != NULL) {
+      FORWARD(keys[i]);
+      forwardValue(&values[i]);
+    }
+  }
+}
+
+static void forwardCaches(Chunk *chunk) {
+  for (uint32_t i = 0; i < chunk->cacheCount; i++) {
+    InlineCache *cache = &chunk->caches[i];
+    FORWARD(cache->name);
+    for (int j = 0; j < cache->count; j++) {
+      FORWARD(cache->entries[j].shape);
+      FORWARD(cache->entries[j].transition);
+      FORWARD(cache->entries[j].method);
+    }
+  }
+}
+
+// the pointers an object keeps into itself
+static void movedObject(void *from, void *to) {
+  Obj *object = (Obj *)to;
+  if (object->type == OBJ_INSTANCE) {
+    ObjInstance *instance = (ObjInstance *)to;
+    if (instance->fields == ((ObjInstance *)from)->inlineFields) {
+      instance->fields = instance->inlineFields;
+    }
+  } else if (object->type == OBJ_UPVALUE) {
+    ObjUpvalue *upvalue = (ObjUpvalue *)to;
+    if (upvalue->location == &((ObjUpvalue *)from)->closed) {
+      upvalue->location = &upvalue->closed;
+    }
+  }
+}
+
+static void forwardObject(void *pointer) {
+  Obj *object = (Obj *)pointer;
+  switch (object->type) {
+  case OBJ_BOUND_METHOD: {
+    ObjBoundMethod *bound = (ObjBoundMethod *)object;
+    forwardValue(&bound->receiver);
+    FORWARD(bound->method);
+    break;
+  }
+  case OBJ_INSTANCE: {
+    ObjInstance *instance = (ObjInstance *)object;
+    FORWARD(instance->klass);
+    FORWARD(instance->shape);
+    if (instance->shape != NULL) {
+      for (int i = 0; i < instance->shape->fieldCount; i++) {
+        forwardValue(&instance->fields[i]);
+      }
+    }
+    forwardTable(&instance->dictionary);
+    break;
+  }
+  case OBJ_SHAPE: {
+    ObjShape *shape = (ObjShape *)object;
+    for (int i = 0; i < shape->fieldCount; i++) {
+      FORWARD(shape->names[i]);
+    }
+    forwardTable(&shape->slots);
+    forwardTable(&shape->transitions);
+    break;
+  }
+  case OBJ_CLASS: {
+    ObjClass *klass = (ObjClass *)object;
+    forwardTable(&klass->methods);
+    FORWARD(klass->name);
+    FORWARD(klass->rootShape);
+    break;
+  }
+  case OBJ_CLOSURE: {
+    ObjClosure *closure = (ObjClosure *)object;
+    FORWARD(closure->function);
+    for (int i = 0; i < closure->upvalueCount; i++) {
+      FORWARD(closure->upvalues[i]);
+    }
+    break;
+  }
+  case OBJ_FUNCTION: {
+    ObjFunction *function = (ObjFunction *)object;
+    FORWARD(function->name);
+    forwardArray(&function->chunk.constants);
+    forwardCaches(&function->chunk);
+    break;
+  }
+  case OBJ_UPVALUE: {
+    ObjUpvalue *upvalue = (ObjUpvalue *)object;
+    forwardValue(&upvalue->closed);
+    // closed upvalues may still point at ones since freed
+    if (upvalue->location != &upvalue->closed) {
+      FORWARD(upvalue->next);
+    }
+    break;
+  }
+  case OBJ_ROPE: {
+    ObjRope *rope = (ObjRope *)object;
+    FORWARD(rope->left);
+    FORWARD(rope->right);
+    FORWARD(rope->flat);
+    break;
+  }
+  case OBJ_NATIVE:
+  case OBJ_STRING:
+    break;
+  }
+}
+
+// every reference from outside the heap. the compiler is not running at
+// a safe point, so it has none.
+static void forwardRoots() {
+  for (Value *slot = vm.stack.items; slot < vm.stack.top; slot++) {
+    forwardValue(slot);
+  }
+  for (int i = 0; i < vm.frameCount; i++) {
+    FORWARD(vm.frames[i].closure);
+  }
+  FORWARD(vm.openUpvalues);
+  forwardTable(&vm.strings);
+  forwardTable(&vm.globalSlots);
+  forwardArray(&vm.globalNames);
+  forwardArray(&vm.globalValues);
+  FORWARD(vm.initString);
+  FORWARD(vm.gcStatsClass);
+  FORWARD(vm.gcFreedClass);
+  for (int i = 0; i < vm.rememberedCount; i++) {
+    FORWARD(vm.remembered[i]);
+  }
+}
+
+// a program over the heap limit gets one full collection to get back under
+// it, and ends here if that is not enough
+static void checkHeapLimit() {
+  if (vm.gcMaxHeap == 0 || vm.bytesAllocated <= vm.gcMaxHeap) {
+    return;
+  }
+  collectGarbage();
+  if (vm.bytesAllocated > vm.gcMaxHeap) {
+    fprintf(stderr, "Out of memory, the heap limit is %zu bytes.\n",
+            vm.gcMaxHeap);
+    exit(1);
+  }
+}
+
+// moves the objects out of sparse arenas and unmaps them, so a long
+// running program gives back what its peaks left behind. objects only
+// move between instructions, when no C code holds on to any of them.
+void compactHeap() {
+  vm.compactPending = false;
+  if (vm.gcPhase != GC_IDLE) {
+    return;
+  }
+
+  uint64_t start = gcClock();
+#ifdef DEBUG_STRESS_GC
+  bool everything = true;
+#else
+  bool everything = false;
+#endif
+  if (!heapPlanCompaction(everything)) {
+    return;
+  }
+  heapEvacuate(movedObject);
+  forwardRoots();
+  heapEachObject(forwardObject);
+  int released = heapReleaseEvacuated();
+  pauseEnd(start, NULL);
 
 #ifdef DEBUG_LOG_GC
-  printf("-- gc end\n");
-  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
-         before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+  printf("-- compacted, %d arenas released\n", released);
+#else
+  (void)released;
 #endif
 }
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "heap.h"
 #include "memory.h"
 #include "object.h"
 #include "stack.h"
@@ -15,11 +16,9 @@
   (type *)allocateObject(totalSize, objectType)
 
 static Obj *allocateObject(size_t size, ObjType type) {
-  Obj *object = (Obj *)reallocate(NULL, 0, size, true);
+  Obj *object = (Obj *)allocateHeapObject(size);
   object->type = type;
-  object->next = vm.objects;
-  object->isMarked = false;
-  vm.objects = object;
+  object->flags = size > HEAP_MAX_CELL ? OBJ_LARGE : 0;
 
 #ifdef DEBUG_LOG_GC
   printf("%p allocate %zu for %d\n", (void *)object, size, type);
@@ -32,6 +31,7 @@ ObjFunction *newFunction() {
   ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->maxSlots = 0;
   function->name = NULL;
   initChunk(&function->chunk);
   return function;
@@ -40,7 +40,14 @@ ObjFunction *newFunction() {
 ObjClass *newClass(ObjString *name) {
   ObjClass *klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
   klass->name = name;
+  klass->rootShape = NULL;
+  klass->instanceFields = 0;
+  klass->hasCachedMethods = false;
   initTable(&klass->methods);
+  stackPush(&vm.stack, OBJ_VAL(klass));
+  klass->rootShape = newShape(NULL, NULL);
+  writeBarrier((Obj *)klass);
+  stackPop(&vm.stack);
   return klass;
 }
 
@@ -52,12 +59,119 @@ ObjBoundMethod *newBoundMethod(Value receiver, ObjClosure *method) {
 }
 
 ObjInstance *newInstance(ObjClass *klass) {
-  ObjInstance *instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+  int inlineCount = klass->instanceFields;
+  ObjInstance *instance = (ObjInstance *)allocateObject(
+      sizeof(ObjInstance) + sizeof(Value) * inlineCount, OBJ_INSTANCE);
   instance->klass = klass;
-  initTable(&instance->fields);
+  instance->shape = klass->rootShape;
+  instance->fields = instance->inlineFields;
+  instance->fieldCapacity = inlineCount;
+  instance->inlineCount = inlineCount;
+  initTable(&instance->dictionary);
   return instance;
 }
 
+ObjShape *newShape(ObjShape *parent, ObjString *name) {
+  int fieldCount = parent == NULL ? 0 : parent->fieldCount + 1;
+  // the names are allocated first, as the shape is not reachable yet
+  ObjString **names = ALLOCATE(ObjString *, fieldCount);
+  for (int i = 0; i < fieldCount - 1; i++) {
+    names[i] = parent->names[i];
+  }
+  if (fieldCount > 0) {
+    names[fieldCount - 1] = name;
+  }
+
+  ObjShape *shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+  shape->fieldCount = fieldCount;
+  shape->names = names;
+  initTable(&shape->slots);
+  initTable(&shape->transitions);
+
+  if (fieldCount > SHAPE_LINEAR_FIELDS) {
+    stackPush(&vm.stack, OBJ_VAL(shape));
+    for (int i = 0; i < fieldCount; i++) {
+      tableSet(&shape->slots, names[i], IDX_VAL(i));
+    }
+    stackPop(&vm.stack);
+  }
+  return shape;
+}
+
+ObjShape *shapeTransition(ObjShape *shape, ObjString *name) {
+  Value next;
+  if (tableGet(&shape->transitions, name, &next)) {
+    return AS_SHAPE(next);
+  }
+
+  ObjShape *child = newShape(shape, name);
+  stackPush(&vm.stack, OBJ_VAL(child));
+  tableSet(&shape->transitions, name, OBJ_VAL(child));
+  writeBarrier((Obj *)shape);
+  stackPop(&vm.stack);
+  return child;
+}
+
+static void instanceToDictionary(ObjInstance *instance) {
+  ObjShape *shape = instance->shape;
+  for (int i = 0; i < shape->fieldCount; i++) {
+    tableSet(&instance->dictionary, shape->names[i], instance->fields[i]);
+  }
+  instance->shape = NULL;
+  if (instance->fields != instance->inlineFields) {
+    FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+  }
+  instance->fields = instance->inlineFields;
+  instance->fieldCapacity = instance->inlineCount;
+}
+
+static void storeField(ObjInstance *instance, ObjString *name, Value value) {
+  if (instance->shape == NULL) {
+    tableSet(&instance->dictionary, name, value);
+    return;
+  }
+
+  int slot = shapeFindSlot(instance->shape, name);
+  if (slot != -1) {
+    instance->fields[slot] = value;
+    return;
+  }
+
+  slot = instance->shape->fieldCount;
+  if (slot == SHAPE_MAX_FIELDS) {
+    instanceToDictionary(instance);
+    tableSet(&instance->dictionary, name, value);
+    return;
+  }
+
+  ObjShape *next = shapeTransition(instance->shape, name);
+  if (slot == instance->fieldCapacity) {
+    int capacity = GROW_CAPACITY(instance->fieldCapacity);
+    Value *fields = ALLOCATE(Value, capacity);
+    for (int i = 0; i < slot; i++) {
+      fields[i] = instance->fields[i];
+    }
+    if (instance->fields != instance->inlineFields) {
+      FREE_ARRAY(Value, instance->fields, instance->fieldCapacity);
+    }
+    instance->fields = fields;
+    instance->fieldCapacity = capacity;
+  }
+  instance->fields[slot] = value;
+  instance->shape = next;
+
+  ObjClass *klass = instance->klass;
+  if (klass->instanceFields < next->fieldCount) {
+    klass->instanceFields = next->fieldCount;
+  }
+}
+
+// both the instance and the value must be reachable by the GC
+void instanceSetField(ObjInstance *instance, ObjString *name, Value value) {
+  storeField(instance, name, value);
+  writeBarrier((Obj *)instance);
+}
+
 ObjClosure *newClosure(ObjFunction *function) {
   ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalueCount);
 
@@ -78,9 +192,9 @@ ObjNative *newNative(NativeFn function) {
   return native;
 }
 
-ObjUpvalue *newUpvalue(int pos) {
+ObjUpvalue *newUpvalue(Value *slot) {
   ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
-  upvalue->location = pos;
+  upvalue->location = slot;
   upvalue->next = NULL;
   upvalue->closed = NIL_VAL;
   return upvalue;
@@ -102,8 +216,8 @@ static ObjString *allocateString(int length) {
   return string;
 }
 
-ObjString *createString(int lenght) { return allocateString(lenght); }
-
+// every string is interned, so two strings are equal only if they are the
+// same object
 ObjString *copyString(const char *chars, int length) {
   // we first try to look if the string already exists in the table
   uint32_t hash = hashString(chars, length);
@@ -123,6 +237,116 @@ ObjString *copyString(const char *chars, int length) {
   return string;
 }
 
+static int stringLength(Obj *string) {
+  return string->type == OBJ_ROPE ? ((ObjRope *)string)->length
+                                  : ((ObjString *)string)->length;
+}
+
+static int ropeDepth(Obj *string) {
+  return string->type == OBJ_ROPE ? ((ObjRope *)string)->depth : 0;
+}
+
+// left and right have to be reachable, the result is a rope unless it is
+// short
+Obj *concatenateStrings(Obj *left, Obj *right) {
+  int length = stringLength(left) + stringLength(right);
+  if (length < ROPE_MIN_LENGTH) {
+    // ropes are never this short, so both sides are flat
+    ObjString *a = (ObjString *)left;
+    ObjString *b = (ObjString *)right;
+    char chars[ROPE_MIN_LENGTH];
+    memcpy(chars, a->chars, a->length);
+    memcpy(chars + a->length, b->chars, b->length);
+    return (Obj *)copyString(chars, length);
+  }
+
+  // a right side nested too deep is flattened, the rope keeps it alive
+  if (ropeDepth(right) == ROPE_MAX_DEPTH) {
+    right = (Obj *)flattenRope((ObjRope *)right);
+  }
+  int depth = ropeDepth(right) + 1;
+  if (ropeDepth(left) > depth) {
+    depth = ropeDepth(left);
+  }
+
+  ObjRope *rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+  rope->length = length;
+  rope->depth = depth;
+  rope->left = left;
+  rope->right = right;
+  rope->flat = NULL;
+  return (Obj *)rope;
+}
+
+ObjString *flattenRope(ObjRope *rope) {
+  if (rope->flat != NULL) {
+    return rope->flat;
+  }
+
+  stackPush(&vm.stack, OBJ_VAL(rope));
+  ObjString *flat = allocateString(rope->length);
+
+  // the pieces are copied from the end backwards. a rope on the stack
+  // leaves its left side there while its right side is copied, so the
+  // stack never holds more than one piece per level of depth
+  Obj *pieces[ROPE_MAX_DEPTH + 1];
+  int count = 0;
+  int end = rope->length;
+  pieces[count++] = (Obj *)rope;
+  while (count > 0) {
+    Obj *piece = pieces[--count];
+    ObjString *string;
+    if (piece->type == OBJ_ROPE) {
+      ObjRope *inner = (ObjRope *)piece;
+      if (inner->flat == NULL) {
+        pieces[count++] = inner->left;
+        pieces[count++] = inner->right;
+        continue;
+      }
+      string = inner->flat;
+    } else {
+      string = (ObjString *)piece;
+    }
+    end -= string->length;
+    memcpy(flat->chars + end, string->chars, string->length);
+  }
+  flat->chars[rope->length] = '\0';
+
+  // the flat copy is interned like any other string, the new one is
+  // garbage if it already was
+  flat->hash = hashString(flat->chars, flat->length);
+  ObjString *interned =
+      tableFindString(&vm.strings, flat->chars, flat->length, flat->hash);
+  if (interned != NULL) {
+    flat = interned;
+  } else {
+    stackPush(&vm.stack, OBJ_VAL(flat));
+    tableSet(&vm.strings, flat, NIL_VAL);
+    stackPop(&vm.stack);
+  }
+  stackPop(&vm.stack);
+
+  rope->flat = flat;
+  rope->left = NULL;
+  rope->right = NULL;
+  rope->depth = 0;
+  writeBarrier((Obj *)rope);
+  return flat;
+}
+
+// a rope is equal to a string or another rope once both are flattened,
+// the lengths are compared first so that most ropes need not be
+bool ropesEqual(Value a, Value b) {
+  if (!IS_ROPE(a) && !IS_ROPE(b)) {
+    return false;
+  }
+  if (!IS_ANY_STRING(a) || !IS_ANY_STRING(b) ||
+      stringLength(AS_OBJ(a)) != stringLength(AS_OBJ(b))) {
+    return false;
+  }
+  return asFlatString(a) == asFlatString(b);
+}
+
 static void printFunction(ObjFunction *function) {
   if (function->name == NULL) {
     printf("<script>");
@@ -156,6 +380,12 @@ void printObject(Value value) {
   case OBJ_NATIVE:
     printf("<native fn>");
     break;
+  case OBJ_ROPE:
+    printf("%s", flattenRope(AS_ROPE(value))->chars);
+    break;
+  case OBJ_SHAPE:
+    printf("shape");
+    break;
   case OBJ_UPVALUE:
     printf("upvalue");
     break;
@@ -0,0 +1,370 @@
+#include "optimizer.h"
+#include "memory.h"
+#include "object.h"
+
+#include <string.h>
+
+typedef struct {
+  // where it starts in the code as compiled
+  uint32_t offset;
+  int length;
+  // OP_LOOP is kept as OP_JUMP, the direction is picked when it is written
+  uint8_t op;
+  // index of the instruction a jump lands on, -1 for the rest
+  int target;
+  int line;
+  bool live;
+} Instruction;
+
+typedef struct {
+  Chunk *chunk;
+  Instruction *code;
+  int count;
+  // how many live jumps land on each instruction, and on the end
+  int *targets;
+} Optimizer;
+
+static bool isJump(uint8_t op) {
+  return op == OP_JUMP || op == OP_JUMP_IF_FALSE ||
+         op == OP_POP_JUMP_IF_FALSE || op == OP_POP_JUMP_IF_TRUE;
+}
+
+static bool isPopJump(uint8_t op) {
+  return op == OP_POP_JUMP_IF_FALSE || op == OP_POP_JUMP_IF_TRUE;
+}
+
+static void decode(Optimizer *opt, Chunk *chunk) {
+  opt->chunk = chunk;
+  opt->count = 0;
+  for (uint32_t offset = 0; offset < chunk->count;
+       offset += instructionLength(chunk, offset)) {
+    opt->count++;
+  }
+  opt->code = ALLOCATE(Instruction, opt->count);
+  opt->targets = ALLOCATE(int, opt->count + 1);
+  int *indexAt = ALLOCATE(int, chunk->count + 1);
+
+  Line *lines = chunk->lines.lines;
+  int run = 0;
+  uint32_t runStart = 0;
+  uint32_t offset = 0;
+  for (int i = 0; i < opt->count; i++) {
+    while (offset >= runStart + lines[run].count) {
+      runStart += lines[run].count;
+      run++;
+    }
+    Instruction *instruction = &opt->code[i];
+    instruction->offset = offset;
+    instruction->length = instructionLength(chunk, offset);
+    instruction->op = chunk->code[offset];
+    instruction->target = -1;
+    instruction->line = lines[run].line;
+    instruction->live = true;
+    indexAt[offset] = i;
+    offset += instruction->length;
+  }
+  indexAt[chunk->count] = opt->count;
+
+  for (int i = 0; i < opt->count; i++) {
+    Instruction *instruction = &opt->code[i];
+    if (!isJump(instruction->op) && instruction->op != OP_LOOP) {
+      continue;
+    }
+    uint8_t *code = &chunk->code[instruction->offset];
+    int jump = (code[1] << 8) | code[2];
+    uint32_t after = instruction->offset + 3;
+    if (instruction->op == OP_LOOP) {
+      instruction->op = OP_JUMP;
+      instruction->target = indexAt[after - jump];
+    } else {
+      instruction->target = indexAt[after + jump];
+    }
+  }
+  FREE_ARRAY(int, indexAt, chunk->count + 1);
+}
+
+// the first live instruction from index on. a jump to a dropped
+// instruction lands on whatever follows it.
+static int nextLive(Optimizer *opt, int index) {
+  while (index < opt->count && !opt->code[index].live) {
+    index++;
+  }
+  return index;
+}
+
+static int targetOf(Optimizer *opt, int index) {
+  return nextLive(opt, opt->code[index].target);
+}
+
+static void countTargets(Optimizer *opt) {
+  memset(opt->targets, 0, sizeof(int) * (opt->count + 1));
+  for (int i = 0; i < opt->count; i++) {
+    if (opt->code[i].live && opt->code[i].target != -1) {
+      opt->targets[targetOf(opt, i)]++;
+    }
+  }
+}
+
+static void setTarget(Optimizer *opt, int index, int target) {
+  opt->targets[targetOf(opt, index)]--;
+  opt->code[index].target = target;
+  if (target != -1) {
+    opt->targets[target]++;
+  }
+}
+
+static void drop(Optimizer *opt, int index) {
+  if (opt->code[index].target != -1) {
+    setTarget(opt, index, -1);
+  }
+  opt->code[index].live = false;
+  // the jumps that landed on it now land on the next one
+  opt->targets[nextLive(opt, index)] += opt->targets[index];
+  opt->targets[index] = 0;
+}
+
+// jumps to an unconditional jump go straight to where it goes, and so do
+// conditional jumps to a jump on the same condition. a conditional jump
+// only ever goes forwards.
+static bool threadJump(Optimizer *opt, int index) {
+  Instruction *instruction = &opt->code[index];
+  int target = targetOf(opt, index);
+  for (int steps = 0; target < opt->count && steps < opt->count; steps++) {
+    Instruction *next = &opt->code[target];
+    bool sameJump = instruction->op == OP_JUMP_IF_FALSE &&
+                    next->op == OP_JUMP_IF_FALSE;
+    if (next->op != OP_JUMP && !sameJump) {
+      break;
+    }
+    int after = targetOf(opt, target);
+    if (after == target || after == index ||
+        (instruction->op != OP_JUMP && after < index)) {
+      break;
+    }
+    target = after;
+  }
+  if (target == targetOf(opt, index)) {
+    return false;
+  }
+  setTarget(opt, index, target);
+  return true;
+}
+
+static bool isFalseyConstant(Optimizer *opt, Instruction *instruction) {
+  switch (instruction->op) {
+  case OP_NIL:
+  case OP_FALSE:
+    return true;
+  case OP_TRUE:
+    return false;
+  default: {
+    uint32_t constant =
+        readOperand(opt->chunk, instruction->offset,
+                    instruction->op == OP_CONSTANT_LONG);
+    Value value = opt->chunk->constants.values[constant];
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+  }
+  }
+}
+
+// applies the first rule that matches at index
+static bool rewrite(Optimizer *opt, int index) {
+  Instruction *instruction = &opt->code[index];
+  int next = nextLive(opt, index + 1);
+
+  if (isJump(instruction->op)) {
+    if (threadJump(opt, index)) {
+      return true;
+    }
+    if (targetOf(opt, index) != next) {
+      return false;
+    }
+    // a jump to the next instruction only has to pop, if anything
+    if (isPopJump(instruction->op)) {
+      setTarget(opt, index, -1);
+      instruction->op = OP_POP;
+    } else {
+      drop(opt, index);
+    }
+    return true;
+  }
+
+  // the rest replace a pair of instructions, which has to be entered at
+  // the first one
+  if (next == opt->count || opt->targets[next] > 0) {
+    return false;
+  }
+  Instruction *following = &opt->code[next];
+  switch (instruction->op) {
+  case OP_NOT:
+    if (isPopJump(following->op)) {
+      following->op = following->op == OP_POP_JUMP_IF_FALSE
+                          ? OP_POP_JUMP_IF_TRUE
+                          : OP_POP_JUMP_IF_FALSE;
+      drop(opt, index);
+      return true;
+    }
+    return false;
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_CONSTANT:
+  case OP_CONSTANT_LONG:
+    // a branch on a constant is always taken or never
+    if (isPopJump(following->op)) {
+      bool taken = isFalseyConstant(opt, instruction) ==
+                   (following->op == OP_POP_JUMP_IF_FALSE);
+      drop(opt, index);
+      if (taken) {
+        following->op = OP_JUMP;
+      } else {
+        drop(opt, next);
+      }
+      return true;
+    }
+    // fallthrough
+  case OP_GET_LOCAL:
+  case OP_GET_LOCAL_LONG:
+  case OP_GET_UPVALUE:
+  case OP_GET_UPVALUE_LONG:
+    // a value pushed only to be popped
+    if (following->op == OP_POP) {
+      drop(opt, index);
+      drop(opt, next);
+      return true;
+    }
+    return false;
+  default:
+    return false;
+  }
+}
+
+static bool fallsThrough(uint8_t op) {
+  return op != OP_JUMP && op != OP_RETURN;
+}
+
+// drops whatever can't be reached from the start of the function
+static bool dropUnreachable(Optimizer *opt) {
+  bool *reached = ALLOCATE(bool, opt->count + 1);
+  int *work = ALLOCATE(int, opt->count + 1);
+  memset(reached, 0, sizeof(bool) * (opt->count + 1));
+  int workCount = 0;
+
+  int start = nextLive(opt, 0);
+  reached[start] = true;
+  work[workCount++] = start;
+  while (workCount > 0) {
+    int index = work[--workCount];
+    if (index == opt->count) {
+      continue;
+    }
+    int successors[2];
+    int successorCount = 0;
+    if (opt->code[index].target != -1) {
+      successors[successorCount++] = targetOf(opt, index);
+    }
+    if (fallsThrough(opt->code[index].op)) {
+      successors[successorCount++] = nextLive(opt, index + 1);
+    }
+    for (int i = 0; i < successorCount; i++) {
+      if (!reached[successors[i]]) {
+        reached[successors[i]] = true;
+        work[workCount++] = successors[i];
+      }
+    }
+  }
+
+  bool dropped = false;
+  for (int i = 0; i < opt->count; i++) {
+    if (opt->code[i].live && !reached[i]) {
+      opt->code[i].live = false;
+      dropped = true;
+    }
+  }
+  FREE_ARRAY(bool, reached, opt->count + 1);
+  FREE_ARRAY(int, work, opt->count + 1);
+  return dropped;
+}
+
+// writes the live instructions back, unless a jump got too long
+static void encode(Optimizer *opt) {
+  Chunk *chunk = opt->chunk;
+  uint32_t *offsets = ALLOCATE(uint32_t, opt->count + 1);
+  uint32_t count = 0;
+  for (int i = 0; i < opt->count; i++) {
+    offsets[i] = count;
+    if (opt->code[i].live) {
+      count += opt->code[i].length;
+    }
+  }
+  offsets[opt->count] = count;
+
+  for (int i = 0; i < opt->count; i++) {
+    if (opt->code[i].live && opt->code[i].target != -1) {
+      uint32_t to = offsets[targetOf(opt, i)];
+      uint32_t after = offsets[i] + 3;
+      if ((to >= after ? to - after : after - to) > UINT16_MAX) {
+        FREE_ARRAY(uint32_t, offsets, opt->count + 1);
+        return;
+      }
+    }
+  }
+
+  uint8_t *code = ALLOCATE(uint8_t, count);
+  LineArray lines;
+  initLineArray(&lines);
+  for (int i = 0; i < opt->count; i++) {
+    Instruction *instruction = &opt->code[i];
+    if (!instruction->live) {
+      continue;
+    }
+    uint8_t *bytes = &code[offsets[i]];
+    memcpy(bytes, &chunk->code[instruction->offset], instruction->length);
+    bytes[0] = instruction->op;
+    if (instruction->target != -1) {
+      uint32_t to = offsets[targetOf(opt, i)];
+      uint32_t after = offsets[i] + 3;
+      uint32_t jump = to - after;
+      if (to < after) {
+        bytes[0] = OP_LOOP;
+        jump = after - to;
+      }
+      bytes[1] = (jump >> 8) & 0xff;
+      bytes[2] = jump & 0xff;
+    }
+    for (int j = 0; j < instruction->length; j++) {
+      writeLineArray(&lines, instruction->line);
+    }
+  }
+  FREE_ARRAY(uint32_t, offsets, opt->count + 1);
+
+  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+  freeLineArray(&chunk->lines);
+  chunk->code = code;
+  chunk->count = count;
+  chunk->capacity = count;
+  chunk->lines = lines;
+}
+
+void optimizeChunk(Chunk *chunk) {
+  Optimizer opt;
+  decode(&opt, chunk);
+
+  bool changed;
+  do {
+    changed = false;
+    countTargets(&opt);
+    for (int i = 0; i < opt.count; i++) {
+      if (opt.code[i].live && rewrite(&opt, i)) {
+        changed = true;
+      }
+    }
+    if (dropUnreachable(&opt)) {
+      changed = true;
+    }
+  } while (changed);
+
+  encode(&opt);
+  FREE_ARRAY(Instruction, opt.code, opt.count);
+  FREE_ARRAY(int, opt.targets, opt.count + 1);
+}
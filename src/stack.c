@@ -1,37 +1,45 @@
 #include "stack.h"
-#include "memory.h"
-#include <stdio.h>
 
-void stackPush(Stack *stack, Value value) {
-  if (stack->capacity <= stack->top) {
-    int oldCapacity = stack->capacity;
-    stack->capacity = GROW_CAPACITY(oldCapacity);
-    // triggering the gc here would result in unexpected behavior
-    // as we depend on the stack to track objects for gc cleanup
-    stack->items =
-        GROW_ARRAY_NO_GC(Value, stack->items, oldCapacity, stack->capacity);
-  }
-  stack->items[stack->top] = value;
-  stack->top++;
-}
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
-Value stackPop(Stack *stack) {
-  stack->top--;
-  return stack->items[stack->top];
-}
+void initStack(Stack *stack, size_t slots) {
+  size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+  size_t size = slots * sizeof(Value);
+  size = (size + pageSize - 1) & ~(pageSize - 1);
 
-Value stackPeek(Stack *stack, int distance) {
-  return stack->items[stack->top - 1 - distance];
-}
+  // one extra page after the stack that faults on any access,
+  // an overflow crashes instead of silently writing over the heap
+  uint8_t *mapping = mmap(NULL, size + pageSize, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "Could not allocate the VM stack.\n");
+    exit(1);
+  }
+  if (mprotect(mapping + size, pageSize, PROT_NONE) != 0) {
+    fprintf(stderr, "Could not protect the VM stack.\n");
+    exit(1);
+  }
 
-void initStack(Stack *stack) {
-  stack->capacity = 0;
-  stack->top = 0;
-  stack->items = NULL;
+  stack->mapping = mapping;
+  stack->mappingSize = size + pageSize;
+  // the last slot sits right below the guard page
+  stack->end = (Value *)(mapping + size);
+  stack->items = stack->end - slots;
+  stack->top = stack->items;
 }
 
 void freeStack(Stack *stack) {
-  FREE_ARRAY(Value, stack->items, stack->capacity);
+  if (stack->mapping != NULL) {
+    munmap(stack->mapping, stack->mappingSize);
+  }
+  stack->mapping = NULL;
+  stack->mappingSize = 0;
+  stack->items = NULL;
+  stack->top = NULL;
+  stack->end = NULL;
 }
 
-void resetStack(Stack *stack) { stack->top = 0; }
\ No newline at end of file
+void resetStack(Stack *stack) { stack->top = stack->items; }
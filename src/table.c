@@ -1,49 +1,131 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+// keys and tombstones together fill at most three quarters of the slots
+#define TABLE_MAX_LOAD(capacity) ((capacity) / 4 * 3)
+
+// the high bits of a hash pick the group a probe starts from, the low
+// seven are kept in the control byte
+#define HASH_GROUP(hash) ((hash) >> 7)
+#define HASH_TAG(hash) ((uint8_t)((hash)&0x7f))
+
+#ifdef __SSE2__
+typedef __m128i Group;
+
+static inline Group loadGroup(const uint8_t *control) {
+  return _mm_loadu_si128((const __m128i *)control);
+}
+
+// a bit for every slot of the group whose control byte is byte
+static inline uint32_t matchByte(Group group, uint8_t byte) {
+  return (uint32_t)_mm_movemask_epi8(
+      _mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+}
+
+// empty slots and tombstones are the ones with the top bit set
+static inline uint32_t matchFree(Group group) {
+  return (uint32_t)_mm_movemask_epi8(group);
+}
+#else
+typedef const uint8_t *Group;
+
+static inline Group loadGroup(const uint8_t *control) { return control; }
+
+static inline uint32_t matchByte(Group group, uint8_t byte) {
+  uint32_t match = 0;
+  for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+    match |= (uint32_t)(group[i] == byte) << i;
+  }
+  return match;
+}
+
+static inline uint32_t matchFree(Group group) {
+  uint32_t match = 0;
+  for (int i = 0; i < TABLE_GROUP_WIDTH; i++) {
+    match |= (uint32_t)(group[i] >> 7) << i;
+  }
+  return match;
+}
+#endif
+
+// groups are probed in triangular steps, which visit every one of them
+// since there is a power of two
+#define FOR_EACH_GROUP(capacity, hash, base)                                  \
+  for (uint32_t groupMask_ = (uint32_t)(capacity) / TABLE_GROUP_WIDTH - 1,   \
+                group_ = HASH_GROUP(hash) & groupMask_, step_ = 1,           \
+                base = group_ * TABLE_GROUP_WIDTH;                           \
+       ; group_ = (group_ + step_++) & groupMask_,                           \
+                base = group_ * TABLE_GROUP_WIDTH)
+
+static size_t blockSize(int capacity) {
+  return (size_t)capacity * (1 + sizeof(ObjString *) + sizeof(Value));
+}
 
 void initTable(Table *table) {
   table->count = 0;
   table->capacity = 0;
-  table->entries = NULL;
+  table->control = NULL;
 }
 
 void freeTable(Table *table) {
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  FREE_ARRAY(uint8_t, table->control, blockSize(table->capacity));
   initTable(table);
 }
 
-static Entry *findEntry(Entry *entries, int capacity, ObjString *key) {
-  uint32_t index = key->hash % capacity;
-  Entry *tombstone = NULL;
-
-  for (;;) {
-    Entry *entry = &entries[index];
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
-        // Empty entry.
-        return tombstone != NULL ? tombstone : entry;
-      } else {
-        // We found a tombstone.
-        if (tombstone == NULL) {
-          tombstone = entry;
-        }
+// the slot holding key, or -1
+static int findKey(Table *table, ObjString *key) {
+  ObjString **keys = tableKeys(table);
+  uint8_t tag = HASH_TAG(key->hash);
+  FOR_EACH_GROUP(table->capacity, key->hash, base) {
+    Group group = loadGroup(table->control + base);
+    for (uint32_t match = matchByte(group, tag); match != 0;
+         match &= match - 1) {
+      uint32_t slot = base + __builtin_ctz(match);
+      if (keys[slot] == key) {
+        return slot;
       }
-    } else if (entry->key == key) {
-      // We found the key.
-      return entry;
     }
-    if (entry->key == key || entry->key == NULL) {
-      return entry;
+    // the key would have gone in the empty slot that ends the probe
+    if (matchByte(group, CTRL_EMPTY) != 0) {
+      return -1;
     }
+  }
+}
 
-    index = (index + 1) % capacity;
+// the slot holding key, or else the one it goes in: the first tombstone
+// on its probe sequence, or the empty slot that ends it
+static int findSlot(Table *table, ObjString *key) {
+  ObjString **keys = tableKeys(table);
+  uint8_t tag = HASH_TAG(key->hash);
+  int tombstone = -1;
+  FOR_EACH_GROUP(table->capacity, key->hash, base) {
+    Group group = loadGroup(table->control + base);
+    for (uint32_t match = matchByte(group, tag); match != 0;
+         match &= match - 1) {
+      uint32_t slot = base + __builtin_ctz(match);
+      if (keys[slot] == key) {
+        return slot;
+      }
+    }
+    if (tombstone == -1) {
+      uint32_t deleted = matchByte(group, CTRL_DELETED);
+      if (deleted != 0) {
+        tombstone = base + __builtin_ctz(deleted);
+      }
+    }
+    uint32_t empty = matchByte(group, CTRL_EMPTY);
+    if (empty != 0) {
+      return tombstone != -1 ? tombstone : (int)(base + __builtin_ctz(empty));
+    }
   }
 }
 
@@ -52,72 +134,89 @@ ObjString *tableFindString(Table *table, const char *chars, int length,
   if (table->count == 0)
     return NULL;
 
-  uint32_t index = hash % table->capacity;
-  for (;;) {
-    Entry *entry = &table->entries[index];
-    if (entry->key == NULL) {
-      // Stop if we find an empty non-tombstone entry.
-      if (IS_NIL(entry->value))
-        return NULL;
-    } else if (entry->key->length == length && entry->key->hash == hash &&
-               memcmp(entry->key->chars, chars, length) == 0) {
-      // We found it.
-      return entry->key;
+  ObjString **keys = tableKeys(table);
+  uint8_t tag = HASH_TAG(hash);
+  FOR_EACH_GROUP(table->capacity, hash, base) {
+    Group group = loadGroup(table->control + base);
+    for (uint32_t match = matchByte(group, tag); match != 0;
+         match &= match - 1) {
+      ObjString *key = keys[base + __builtin_ctz(match)];
+      if (key->length == length && key->hash == hash &&
+          memcmp(key->chars, chars, length) == 0) {
+        // We found it.
+        return key;
+      }
+    }
+    // Stop if we find an empty non-tombstone entry.
+    if (matchByte(group, CTRL_EMPTY) != 0) {
+      return NULL;
     }
-
-    index = (index + 1) % table->capacity;
   }
 }
 
 static void adjustCapacity(Table *table, int capacity) {
-  Entry *entries = ALLOCATE(Entry, capacity);
-  for (int i = 0; i < capacity; i++) {
-    entries[i].key = NULL;
-    entries[i].value = NIL_VAL;
-  }
+  Table resized;
+  resized.count = 0;
+  resized.capacity = capacity;
+  resized.control = ALLOCATE(uint8_t, blockSize(capacity));
+  memset(resized.control, CTRL_EMPTY, capacity);
+  ObjString **keys = tableKeys(&resized);
+  Value *values = tableValues(&resized);
+  memset(keys, 0, sizeof(ObjString *) * capacity);
 
-  table->count = 0;
+  // the tombstones are left behind, and every key is known to be new
+  ObjString **oldKeys = tableKeys(table);
+  Value *oldValues = tableValues(table);
   for (int i = 0; i < table->capacity; i++) {
-    Entry *entry = &table->entries[i];
-    if (entry->key == NULL) {
+    ObjString *key = oldKeys[i];
+    if (key == NULL) {
       continue;
     }
 
-    Entry *dest = findEntry(entries, capacity, entry->key);
-    dest->key = entry->key;
-    dest->value = entry->value;
-    table->count++;
+    FOR_EACH_GROUP(capacity, key->hash, base) {
+      uint32_t open = matchFree(loadGroup(resized.control + base));
+      if (open != 0) {
+        uint32_t slot = base + __builtin_ctz(open);
+        resized.control[slot] = HASH_TAG(key->hash);
+        keys[slot] = key;
+        values[slot] = oldValues[i];
+        break;
+      }
+    }
+    resized.count++;
   }
 
   // free the old table
-  FREE_ARRAY(Entry, table->entries, table->capacity);
-
-  table->entries = entries;
-  table->capacity = capacity;
+  freeTable(table);
+  *table = resized;
 }
 
 bool tableSet(Table *table, ObjString *key, Value value) {
-  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-    int capacity = GROW_CAPACITY(table->capacity);
+  if (table->count + 1 > TABLE_MAX_LOAD(table->capacity)) {
+    int capacity = table->capacity < TABLE_GROUP_WIDTH ? TABLE_GROUP_WIDTH
+                                                       : table->capacity * 2;
     adjustCapacity(table, capacity);
   }
 
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  bool isNewKey = entry->key == NULL;
-  if (isNewKey && IS_NIL(entry->value)) {
+  int slot = findSlot(table, key);
+  ObjString **keys = tableKeys(table);
+  bool isNewKey = keys[slot] == NULL;
+  if (isNewKey && table->control[slot] == CTRL_EMPTY) {
     table->count++;
   }
 
-  entry->key = key;
-  entry->value = value;
+  table->control[slot] = HASH_TAG(key->hash);
+  keys[slot] = key;
+  tableValues(table)[slot] = value;
   return isNewKey;
 }
 
 void tableAddAll(Table *from, Table *to) {
+  ObjString **keys = tableKeys(from);
+  Value *values = tableValues(from);
   for (int i = 0; i < from->capacity; i++) {
-    Entry *entry = &from->entries[i];
-    if (entry->key != NULL) {
-      tableSet(to, entry->key, entry->value);
+    if (keys[i] != NULL) {
+      tableSet(to, keys[i], values[i]);
     }
   }
 }
@@ -127,12 +226,12 @@ bool tableGet(Table *table, ObjString *key, Value *value) {
     return false;
   }
 
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) {
+  int slot = findKey(table, key);
+  if (slot == -1) {
     return false;
   }
 
-  *value = entry->value;
+  *value = tableValues(table)[slot];
   return true;
 }
 
@@ -141,30 +240,35 @@ bool tableDelete(Table *table, ObjString *key) {
     return false;
 
   // Find the entry.
-  Entry *entry = findEntry(table->entries, table->capacity, key);
-  if (entry->key == NULL) {
+  int slot = findKey(table, key);
+  if (slot == -1) {
     return false;
   }
 
-  // Place a tombstone in the entry.
-  entry->key = NULL;
-  entry->value = BOOL_VAL(true);
+  // Place a tombstone in the entry. it still counts towards the load, and
+  // probes go on past it
+  table->control[slot] = CTRL_DELETED;
+  tableKeys(table)[slot] = NULL;
   return true;
 }
 
 void markTable(Table *table) {
+  ObjString **keys = tableKeys(table);
+  Value *values = tableValues(table);
   for (int i = 0; i < table->capacity; i++) {
-    Entry *entry = &table->entries[i];
-    markObject((Obj *)entry->key);
-    markValue(entry->value);
+    if (keys[i] != NULL) {
+      markObject((Obj *)keys[i]);
+      markValue(values[i]);
+    }
   }
 }
 
 void tableRemoveWhite(Table *table) {
+  ObjString **keys = tableKeys(table);
   for (int i = 0; i < table->capacity; i++) {
-    Entry *entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->obj.isMarked) {
-      tableDelete(table, entry->key);
+    if (keys[i] != NULL && !isMarked(&keys[i]->obj)) {
+      table->control[i] = CTRL_DELETED;
+      keys[i] = NULL;
     }
   }
-}
\ No newline at end of file
+}
@@ -29,6 +29,21 @@ void freeValueArray(ValueArray *array) {
 }
 
 void printValue(Value value) {
+#ifdef NAN_BOXING
+  if (IS_BOOL(value)) {
+    printf(AS_BOOL(value) ? "true" : "false");
+  } else if (IS_NIL(value)) {
+    printf("nil");
+  } else if (IS_NUMBER(value)) {
+    printf("%g", AS_NUMBER(value));
+  } else if (IS_IDX(value)) {
+    printf("%u", AS_IDX(value));
+  } else if (IS_UNDEFINED(value)) {
+    printf("undefined");
+  } else if (IS_OBJ(value)) {
+    printObject(value);
+  }
+#else
   switch (value.type) {
   case VAL_BOOL:
     printf(AS_BOOL(value) ? "true" : "false");
@@ -42,27 +57,41 @@ void printValue(Value value) {
   case VAL_IDX:
     printf("%u", AS_IDX(value));
     break;
+  case VAL_UNDEFINED:
+    printf("undefined");
+    break;
   case VAL_OBJ:
     printObject(value);
     break;
   default:
     printf("Unknown value type %d\n", value.type);
   }
+#endif
 }
 
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+  // numbers are compared as doubles so that NaN != NaN,
+  // every other value is equal only if the bits are the same
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  }
+  return a == b || ropesEqual(a, b);
+#else
   if (a.type != b.type)
     return false;
   switch (a.type) {
   case VAL_BOOL:
     return AS_BOOL(a) == AS_BOOL(b);
   case VAL_NIL:
+  case VAL_UNDEFINED:
     return true;
   case VAL_NUMBER:
     return AS_NUMBER(a) == AS_NUMBER(b);
   case VAL_OBJ:
-    return AS_OBJ(a) == AS_OBJ(b);
+    return AS_OBJ(a) == AS_OBJ(b) || ropesEqual(a, b);
   default:
     return false; // Unreachable.
   }
-}
\ No newline at end of file
+#endif
+}
@@ -11,9 +11,7 @@
 #include <string.h>
 #include <time.h>
 
-#ifdef DEBUG_TRACE_EXECUTION
 #include "debug.h"
-#endif
 
 static void defineNative(const char *name, NativeFn function);
 
@@ -23,38 +21,128 @@ static Value clockNative(int argCount, Value *args) {
   return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+static Value gcNative(int argCount, Value *args) {
+  collectGarbage();
+  return NIL_VAL;
+}
+
+// field names of the object types, in ObjType order
+static const char *objTypeNames[OBJ_TYPE_COUNT] = {
+    "boundMethod", "class", "closure", "function", "instance",
+    "native",      "rope",  "shape",   "string",   "upvalue",
+};
+
+static ObjClass *newStatsClass(const char *name) {
+  stackPush(&vm.stack, OBJ_VAL(copyString(name, (int)strlen(name))));
+  ObjClass *klass = newClass(AS_STRING(stackPeek(&vm.stack, 0)));
+  stackPop(&vm.stack);
+  return klass;
+}
+
+// pushes an empty instance of klass
+static void pushStatsInstance(ObjClass *klass) {
+  stackPush(&vm.stack, OBJ_VAL(newInstance(klass)));
+}
+
+// sets a field of the instance on top of the stack
+static void setStatsField(const char *name, Value value) {
+  stackPush(&vm.stack, value);
+  stackPush(&vm.stack, OBJ_VAL(copyString(name, (int)strlen(name))));
+  instanceSetField(AS_INSTANCE(stackPeek(&vm.stack, 2)),
+                   AS_STRING(stackPeek(&vm.stack, 0)), value);
+  stackPop(&vm.stack);
+  stackPop(&vm.stack);
+}
+
+// the totals of vm.gcStats as an instance, times in ms
+static Value gcStatsNative(int argCount, Value *args) {
+  GCStats *stats = &vm.gcStats;
+  pushStatsInstance(vm.gcStatsClass);
+  setStatsField("minorCycles", NUMBER_VAL(stats->minorCycles));
+  setStatsField("fullCycles", NUMBER_VAL(stats->fullCycles));
+  setStatsField("pauses", NUMBER_VAL(vm.pauseCount));
+  setStatsField("pauseTotal", NUMBER_VAL(vm.pauseTotal / 1e6));
+  setStatsField("pauseMax", NUMBER_VAL(vm.pauseMax / 1e6));
+  setStatsField("markTime", NUMBER_VAL(stats->markTime / 1e6));
+  setStatsField("sweepTime", NUMBER_VAL(stats->sweepTime / 1e6));
+  setStatsField("heapBytes", NUMBER_VAL(vm.bytesAllocated));
+  setStatsField("bytesFreed", NUMBER_VAL(stats->bytesFreed));
+  setStatsField("grayMax", NUMBER_VAL(stats->grayMax));
+
+  pushStatsInstance(vm.gcFreedClass);
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    setStatsField(objTypeNames[i], NUMBER_VAL(stats->freed[i]));
+  }
+  Value freed = stackPop(&vm.stack);
+  setStatsField("freed", freed);
+  return stackPop(&vm.stack);
+}
+
 void initVM() {
-  initStack(&vm.stack);
+  initStack(&vm.stack, STACK_MAX);
   initTable(&vm.strings);
-  initTable(&vm.globals);
-  defineNative("clock", clockNative);
+  initTable(&vm.globalSlots);
+  initValueArray(&vm.globalNames);
+  initValueArray(&vm.globalValues);
   vm.openUpvalues = NULL;
-  vm.objects = NULL;
+  vm.methodEpoch = 0;
   vm.initString = NULL;
-  vm.initString = copyString("init", 4);
+  vm.gcStatsClass = NULL;
+  vm.gcFreedClass = NULL;
   vm.bytesAllocated = 0;
-  vm.nextGC = 1024 * 1024;
+  vm.nextGC = GC_DEFAULT_INITIAL_HEAP;
+  vm.nurseryBytes = 0;
 
   // GC
+  vm.gcPhase = GC_IDLE;
+  vm.gcInitialHeap = GC_DEFAULT_INITIAL_HEAP;
+  vm.gcGrowth = GC_DEFAULT_GROWTH;
+  vm.gcMaxHeap = 0;
+  vm.sliceBytes = 0;
+  vm.gcBudget = GC_DEFAULT_BUDGET;
+  vm.gcThreads = 1;
+  vm.gcBackgroundSweep = false;
+  vm.gcCompact = true;
+  vm.compactPending = false;
+  vm.pauseCount = 0;
+  vm.pauseTotal = 0;
+  vm.pauseMax = 0;
+  vm.startTime = gcClock();
+  memset(&vm.fullCycle, 0, sizeof(GCCycle));
+  memset(&vm.gcStats, 0, sizeof(GCStats));
+  vm.gcLogCycles = false;
+  vm.optLevel = 1;
   vm.grayCount = 0;
   vm.grayCapacity = 0;
   vm.grayStack = NULL;
+  vm.rememberedCount = 0;
+  vm.rememberedCapacity = 0;
+  vm.remembered = NULL;
+
+  vm.initString = copyString("init", 4);
+  vm.gcStatsClass = newStatsClass("GCStats");
+  vm.gcFreedClass = newStatsClass("GCFreed");
+  defineNative("clock", clockNative);
+  defineNative("gc", gcNative);
+  defineNative("gcStats", gcStatsNative);
 }
 
 void freeVM() {
   freeObjects();
   freeTable(&vm.strings);
-  freeTable(&vm.globals);
+  freeTable(&vm.globalSlots);
+  freeValueArray(&vm.globalNames);
+  freeValueArray(&vm.globalValues);
   // for now, ignore
   // if (vm.chunk->count > 0) {
   //   freeChunk(vm.chunk);
   // }
-  if (vm.stack.capacity > 0) {
-    freeStack(&vm.stack);
-  }
+  freeStack(&vm.stack);
   vm.frameCount = 0;
   vm.openUpvalues = NULL;
   vm.initString = NULL;
+  vm.gcStatsClass = NULL;
+  vm.gcFreedClass = NULL;
 }
 
 static bool isFalsey(Value value) {
@@ -87,22 +175,31 @@ static void runtimeError(const char *format, ...) {
 static void defineNative(const char *name, NativeFn function) {
   stackPush(&vm.stack, OBJ_VAL(copyString(name, (int)strlen(name))));
   stackPush(&vm.stack, OBJ_VAL(newNative(function)));
-  tableSet(&vm.globals, AS_STRING(stackPeek(&vm.stack, 1)),
-           stackPeek(&vm.stack, 0));
+  uint32_t slot = globalSlot(AS_STRING(stackPeek(&vm.stack, 1)));
+  vm.globalValues.values[slot] = stackPeek(&vm.stack, 0);
   stackPop(&vm.stack);
   stackPop(&vm.stack);
 }
 
-static void concatenate() {
-  ObjString *b = AS_STRING(stackPeek(&vm.stack, 0));
-  ObjString *a = AS_STRING(stackPeek(&vm.stack, 1));
+uint32_t globalSlot(ObjString *name) {
+  Value slot;
+  if (tableGet(&vm.globalSlots, name, &slot)) {
+    return AS_IDX(slot);
+  }
+  stackPush(&vm.stack, OBJ_VAL(name));
+  uint32_t index = vm.globalValues.count;
+  writeValueArray(&vm.globalNames, OBJ_VAL(name));
+  writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+  tableSet(&vm.globalSlots, name, IDX_VAL(index));
+  stackPop(&vm.stack);
+  return index;
+}
 
-  int length = a->length + b->length;
-  ObjString *result = createString(length);
+static void concatenate() {
+  Obj *b = AS_OBJ(stackPeek(&vm.stack, 0));
+  Obj *a = AS_OBJ(stackPeek(&vm.stack, 1));
 
-  memcpy(result->chars, a->chars, a->length);
-  memcpy(result->chars + a->length, b->chars, b->length);
-  result->chars[length] = '\0';
+  Obj *result = concatenateStrings(a, b);
   stackPop(&vm.stack);
   stackPop(&vm.stack);
 
@@ -115,14 +212,16 @@ static bool call(ObjClosure *closure, int argCount) {
                  argCount);
     return false;
   }
-  if (vm.frameCount == FRAMES_MAX) {
+  Value *slots = vm.stack.top - argCount - 1;
+  if (vm.frameCount == FRAMES_MAX ||
+      vm.stack.end - slots < closure->function->maxSlots + STACK_SCRATCH) {
     runtimeError("Stack overflow.");
     return false;
   }
   CallFrame *frame = &vm.frames[vm.frameCount++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
-  frame->base = vm.stack.top - argCount - 1;
+  frame->slots = slots;
   return true;
 }
 
@@ -131,12 +230,12 @@ static bool callValue(Value callee, int argCount) {
     switch (OBJ_TYPE(callee)) {
     case OBJ_BOUND_METHOD: {
       ObjBoundMethod *bound = AS_BOUND_METHOD(callee);
-      vm.stack.items[vm.stack.top - argCount - 1] = bound->receiver;
+      vm.stack.top[-argCount - 1] = bound->receiver;
       return call(bound->method, argCount);
     }
     case OBJ_CLASS: {
       ObjClass *klass = AS_CLASS(callee);
-      vm.stack.items[vm.stack.top - argCount - 1] = OBJ_VAL(newInstance(klass));
+      vm.stack.top[-argCount - 1] = OBJ_VAL(newInstance(klass));
       Value initializer;
       if (tableGet(&klass->methods, vm.initString, &initializer)) {
         return call(AS_CLOSURE(initializer), argCount);
@@ -150,7 +249,7 @@ static bool callValue(Value callee, int argCount) {
       return call(AS_CLOSURE(callee), argCount);
     case OBJ_NATIVE: {
       NativeFn native = AS_NATIVE(callee);
-      Value result = native(argCount, &vm.stack.items[vm.stack.top - argCount]);
+      Value result = native(argCount, vm.stack.top - argCount);
       vm.stack.top -= argCount + 1;
       stackPush(&vm.stack, result);
       return true;
@@ -163,16 +262,63 @@ static bool callValue(Value callee, int argCount) {
   return false;
 }
 
-static bool invokeFromClass(ObjClass *klass, ObjString *name, int argCount) {
+static CacheEntry *findCacheEntry(InlineCache *cache, ObjShape *shape) {
+  if (cache->epoch != vm.methodEpoch) {
+    // a cached class changed its methods since this cache was filled
+    cache->count = 0;
+    cache->megamorphic = false;
+    cache->epoch = vm.methodEpoch;
+  }
+  for (int i = 0; i < cache->count; i++) {
+    if (cache->entries[i].shape == shape) {
+      cache->hits++;
+      return &cache->entries[i];
+    }
+  }
+  cache->misses++;
+  return NULL;
+}
+
+static void updateCache(InlineCache *cache, ObjShape *shape,
+                        ObjShape *transition, uint32_t slot,
+                        ObjClosure *method) {
+  if (cache->megamorphic) {
+    return;
+  }
+  if (cache->count == CACHE_ENTRIES) {
+    // too many layouts seen here, stop caching the site
+    cache->megamorphic = true;
+    cache->count = 0;
+    return;
+  }
+  CacheEntry *entry = &cache->entries[cache->count++];
+  entry->shape = shape;
+  entry->transition = transition;
+  entry->slot = slot;
+  entry->method = method;
+  // caches always belong to the function of the running frame
+  writeBarrier((Obj *)vm.frames[vm.frameCount - 1].closure->function);
+}
+
+// the shape of an instance pins both its class and the absence of a
+// field with the method name, so it can key the resolved method.
+// super calls use the root shape of the superclass as key.
+static void cacheMethod(InlineCache *cache, ObjShape *shape, ObjClass *klass,
+                        ObjClosure *method) {
+  klass->hasCachedMethods = true;
+  updateCache(cache, shape, NULL, 0, method);
+}
+
+static ObjClosure *findMethod(ObjClass *klass, ObjString *name) {
   Value method;
   if (!tableGet(&klass->methods, name, &method)) {
     runtimeError("Undefined property '%s'.", name->chars);
-    return false;
+    return NULL;
   }
-  return call(AS_CLOSURE(method), argCount);
+  return AS_CLOSURE(method);
 }
 
-static bool invoke(ObjString *name, int argCount) {
+static bool invoke(InlineCache *cache, int argCount) {
   Value receiver = stackPeek(&vm.stack, argCount);
 
   if (!IS_INSTANCE(receiver)) {
@@ -183,29 +329,28 @@ static bool invoke(ObjString *name, int argCount) {
   ObjInstance *instance = AS_INSTANCE(receiver);
 
   Value value;
-  if (tableGet(&instance->fields, name, &value)) {
-    vm.stack.items[vm.stack.top - argCount - 1] = value;
+  if (instanceGetField(instance, cache->name, &value)) {
+    vm.stack.top[-argCount - 1] = value;
     return callValue(value, argCount);
   }
 
-  return invokeFromClass(instance->klass, name, argCount);
-}
-
-static bool bindMethod(ObjClass *klass, ObjString *name) {
-  Value method;
-  if (!tableGet(&klass->methods, name, &method)) {
-    runtimeError("Undefined property '%s'.", name->chars);
+  ObjClosure *method = findMethod(instance->klass, cache->name);
+  if (method == NULL) {
     return false;
   }
+  if (instance->shape != NULL) {
+    cacheMethod(cache, instance->shape, instance->klass, method);
+  }
+  return call(method, argCount);
+}
 
-  ObjBoundMethod *bound =
-      newBoundMethod(stackPeek(&vm.stack, 0), AS_CLOSURE(method));
+static void bindMethod(ObjClosure *method) {
+  ObjBoundMethod *bound = newBoundMethod(stackPeek(&vm.stack, 0), method);
   stackPop(&vm.stack);
   stackPush(&vm.stack, OBJ_VAL(bound));
-  return true;
 }
 
-static ObjUpvalue *captureUpvalue(int local) {
+static ObjUpvalue *captureUpvalue(Value *local) {
   ObjUpvalue *prevUpvalue = NULL;
   ObjUpvalue *upvalue = vm.openUpvalues;
   while (upvalue != NULL && upvalue->location > local) {
@@ -228,11 +373,12 @@ static ObjUpvalue *captureUpvalue(int local) {
   return createdUpvalue;
 }
 
-static void closeUpvalues(int last) {
+static void closeUpvalues(Value *last) {
   while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
     ObjUpvalue *upvalue = vm.openUpvalues;
-    upvalue->closed = vm.stack.items[upvalue->location];
-    upvalue->location = -1;
+    upvalue->closed = *upvalue->location;
+    upvalue->location = &upvalue->closed;
+    writeBarrier((Obj *)upvalue);
     vm.openUpvalues = upvalue->next;
   }
 }
@@ -241,359 +387,648 @@ static void defineMethod(ObjString *name) {
   Value method = stackPeek(&vm.stack, 0);
   ObjClass *klass = AS_CLASS(stackPeek(&vm.stack, 1));
   tableSet(&klass->methods, name, method);
+  writeBarrier((Obj *)klass);
+  if (klass->hasCachedMethods) {
+    vm.methodEpoch++;
+  }
   stackPop(&vm.stack);
 }
 
+#ifdef DEBUG_TRACE_EXECUTION
+static void traceExecution(CallFrame *frame) {
+  printf("--------------------------\n");
+  if (vm.stack.top > vm.stack.items) {
+    printf("          ");
+    for (Value *slot = vm.stack.items; slot < vm.stack.top; slot++) {
+      printf("[ ");
+      printValue(*slot);
+      printf(" ]");
+    }
+    printf("\n");
+  }
+  disassembleInstruction(
+      &frame->closure->function->chunk,
+      (int)(frame->ip - frame->closure->function->chunk.code));
+}
+#define TRACE_EXECUTION()                                                      \
+  do {                                                                         \
+    STORE_FRAME();                                                             \
+    traceExecution(frame);                                                     \
+  } while (false)
+#else
+#define TRACE_EXECUTION()                                                      \
+  do {                                                                         \
+  } while (false)
+#endif
+
 static InterpretResult run() {
+  // the hot state of the current frame lives in locals so the C compiler
+  // can keep it in registers. it is written back to the frame and to
+  // vm.stack before anything that may look at it (calls, allocations that
+  // can trigger a collection, runtime errors) and read again afterwards.
   CallFrame *frame = &vm.frames[vm.frameCount - 1];
-#define READ_BYTE() (*frame->ip++)
+  uint8_t *ip = frame->ip;
+  Value *slots = frame->slots;
+  Value *stackTop = vm.stack.top;
+#define STORE_FRAME()                                                          \
+  do {                                                                         \
+    frame->ip = ip;                                                            \
+    vm.stack.top = stackTop;                                                   \
+  } while (false)
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    frame = &vm.frames[vm.frameCount - 1];                                     \
+    ip = frame->ip;                                                            \
+    slots = frame->slots;                                                      \
+    stackTop = vm.stack.top;                                                   \
+  } while (false)
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    STORE_FRAME();                                                             \
+    runtimeError(__VA_ARGS__);                                                 \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
+#define PUSH(value) (*stackTop++ = (value))
+#define POP() (*--stackTop)
+#define PEEK(distance) (stackTop[-1 - (distance)])
+#define READ_BYTE() (*ip++)
 #define BINARY_OP(valueType, op)                                               \
   do {                                                                         \
-    if (!IS_NUMBER(stackPeek(&vm.stack, 0)) ||                                 \
-        !IS_NUMBER(stackPeek(&vm.stack, 1))) {                                 \
-      runtimeError("Operands must be numbers.");                               \
-      return INTERPRET_RUNTIME_ERROR;                                          \
+    if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {                          \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
     }                                                                          \
-    double b = AS_NUMBER(stackPop(&vm.stack));                                 \
-    double a = AS_NUMBER(stackPop(&vm.stack));                                 \
-    stackPush(&vm.stack, valueType(a op b));                                   \
+    double b = AS_NUMBER(POP());                                               \
+    double a = AS_NUMBER(POP());                                               \
+    PUSH(valueType(a op b));                                                   \
   } while (false)
+// a quickened OP_ADD whose operands stopped matching goes back to the
+// generic instruction and runs it again, counting the deopt in its operand
+#define DEOPTIMIZE_ADD()                                                       \
+  do {                                                                         \
+    ip[-1] = OP_ADD;                                                           \
+    ip[0]++;                                                                   \
+    ip--;                                                                      \
+    DISPATCH();                                                                \
+  } while (false)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_LONG()                                                            \
+  (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+#define READ_SLOT(isLong) ((isLong) ? READ_LONG() : READ_BYTE())
 #define READ_CONSTANT(isLong)                                                  \
-  (frame->closure->function->chunk.constants                                   \
-       .values[isLong ? ((READ_BYTE() << 16) | (READ_BYTE() << 8) |            \
-                         (READ_BYTE()))                                        \
-                      : READ_BYTE()])
-#define READ_SHORT()                                                           \
-  (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_SLOT(isLong)                                                      \
-  isLong ? ((READ_BYTE() << 16) | (READ_BYTE() << 8) | (READ_BYTE()))          \
-         : READ_BYTE()
+  (frame->closure->function->chunk.constants.values[READ_SLOT(isLong)])
 #define READ_STRING(isLong) AS_STRING(READ_CONSTANT(isLong))
+#define READ_CACHE(isLong)                                                     \
+  (&frame->closure->function->chunk.caches[READ_SLOT(isLong)])
+
+#ifdef COMPUTED_GOTO
+  // one entry per opcode, in the same order as the OpCode enum
+  static void *dispatchTable[] = {
+      &&TARGET_OP_CONSTANT,
+      &&TARGET_OP_CONSTANT_LONG,
+      &&TARGET_OP_DEFINE_GLOBAL,
+      &&TARGET_OP_DEFINE_GLOBAL_LONG,
+      &&TARGET_OP_SET_GLOBAL,
+      &&TARGET_OP_SET_GLOBAL_LONG,
+      &&TARGET_OP_GET_GLOBAL,
+      &&TARGET_OP_GET_GLOBAL_LONG,
+      &&TARGET_OP_GET_LOCAL,
+      &&TARGET_OP_GET_LOCAL_LONG,
+      &&TARGET_OP_SET_LOCAL,
+      &&TARGET_OP_SET_LOCAL_LONG,
+      &&TARGET_OP_CLOSURE,
+      &&TARGET_OP_CLOSURE_LONG,
+      &&TARGET_OP_CLOSE_UPVALUE,
+      &&TARGET_OP_GET_UPVALUE,
+      &&TARGET_OP_GET_UPVALUE_LONG,
+      &&TARGET_OP_SET_UPVALUE,
+      &&TARGET_OP_SET_UPVALUE_LONG,
+      &&TARGET_OP_CLASS,
+      &&TARGET_OP_CLASS_LONG,
+      &&TARGET_OP_GET_PROPERTY,
+      &&TARGET_OP_GET_PROPERTY_LONG,
+      &&TARGET_OP_SET_PROPERTY,
+      &&TARGET_OP_SET_PROPERTY_LONG,
+      &&TARGET_OP_METHOD,
+      &&TARGET_OP_METHOD_LONG,
+      &&TARGET_OP_INVOKE,
+      &&TARGET_OP_INVOKE_LONG,
+      &&TARGET_OP_SUPER_INVOKE,
+      &&TARGET_OP_SUPER_INVOKE_LONG,
+      &&TARGET_OP_GET_SUPER,
+      &&TARGET_OP_GET_SUPER_LONG,
+      &&TARGET_OP_INHERIT,
+      &&TARGET_OP_NIL,
+      &&TARGET_OP_TRUE,
+      &&TARGET_OP_FALSE,
+      &&TARGET_OP_POP,
+      &&TARGET_OP_EQUAL,
+      &&TARGET_OP_GREATER,
+      &&TARGET_OP_LESS,
+      &&TARGET_OP_NOT,
+      &&TARGET_OP_ADD,
+      &&TARGET_OP_SUBTRACT,
+      &&TARGET_OP_MULTIPLY,
+      &&TARGET_OP_DIVIDE,
+      &&TARGET_OP_NEGATE,
+      &&TARGET_OP_PRINT,
+      &&TARGET_OP_LOOP,
+      &&TARGET_OP_CALL,
+      &&TARGET_OP_JUMP,
+      &&TARGET_OP_JUMP_IF_FALSE,
+      &&TARGET_OP_RETURN,
+      &&TARGET_OP_GET_LOCAL_PROPERTY,
+      &&TARGET_OP_SET_LOCAL_POP,
+      &&TARGET_OP_SET_GLOBAL_POP,
+      &&TARGET_OP_POP_JUMP_IF_FALSE,
+      &&TARGET_OP_POP_JUMP_IF_TRUE,
+      &&TARGET_OP_ADD_NUM,
+      &&TARGET_OP_ADD_STR,
+  };
+  // every handler jumps straight to the next one, so each of them gets
+  // its own indirect branch (and its own slot in the branch predictor)
+#define SWITCH(instruction) goto *dispatchTable[instruction];
+#define CASE(op) TARGET_##op
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    TRACE_EXECUTION();                                                         \
+    goto *dispatchTable[READ_BYTE()];                                          \
+  } while (false)
+#else
+#define SWITCH(instruction) switch (instruction)
+#define CASE(op) case op
+#define DISPATCH() continue
+#endif
+// expands a handler twice, once per operand width, so that
+// the width is known at compile time inside each copy
+#define LONG_VARIANTS(op, ...)                                                 \
+  CASE(op) : {                                                                 \
+    const bool isLong = false;                                                 \
+    __VA_ARGS__                                                                \
+  }                                                                            \
+  CASE(op##_LONG) : {                                                          \
+    const bool isLong = true;                                                  \
+    __VA_ARGS__                                                                \
+  }
+
   for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-    printf("--------------------------\n");
-    if (vm.stack.top > 0) {
-      printf("          ");
-      for (int i = 0; i < vm.stack.top; i++) {
-        printf("[ ");
-        printValue(vm.stack.items[i]);
-        printf(" ]");
+    TRACE_EXECUTION();
+    uint8_t instruction = READ_BYTE();
+    SWITCH(instruction) {
+      LONG_VARIANTS(OP_CONSTANT, {
+        PUSH(READ_CONSTANT(isLong));
+        DISPATCH();
+      })
+      CASE(OP_ADD) : {
+        // a site that keeps switching types stays generic
+        bool quicken = READ_BYTE() < ADD_DEOPT_LIMIT;
+        if (IS_ANY_STRING(PEEK(0)) && IS_ANY_STRING(PEEK(1))) {
+          if (quicken) {
+            ip[-2] = OP_ADD_STR;
+          }
+          STORE_FRAME();
+          concatenate();
+          stackTop = vm.stack.top;
+        } else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1))) {
+          if (quicken) {
+            ip[-2] = OP_ADD_NUM;
+          }
+          double b = AS_NUMBER(POP());
+          double a = AS_NUMBER(POP());
+          PUSH(NUMBER_VAL(a + b));
+        } else {
+          RUNTIME_ERROR("Operands must be two numbers or two strings.");
+        }
+        DISPATCH();
       }
-      printf("\n");
-    }
-    disassembleInstruction(
-        &frame->closure->function->chunk,
-        (int)(frame->ip - frame->closure->function->chunk.code));
-#endif
-    uint8_t instruction;
-    bool isLong = false;
-    switch (instruction = READ_BYTE()) {
-    case OP_CONSTANT_LONG:
-      isLong = true; // don't break, fall through
-    case OP_CONSTANT: {
-      Value constant = READ_CONSTANT(isLong);
-      stackPush(&vm.stack, constant);
-      break;
-    }
-    case OP_ADD: {
-      if (IS_STRING(stackPeek(&vm.stack, 0)) &&
-          IS_STRING(stackPeek(&vm.stack, 1))) {
+      CASE(OP_ADD_NUM) : {
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) {
+          DEOPTIMIZE_ADD();
+        }
+        ip++;
+        double b = AS_NUMBER(POP());
+        double a = AS_NUMBER(POP());
+        PUSH(NUMBER_VAL(a + b));
+        DISPATCH();
+      }
+      CASE(OP_ADD_STR) : {
+        if (!IS_ANY_STRING(PEEK(0)) || !IS_ANY_STRING(PEEK(1))) {
+          DEOPTIMIZE_ADD();
+        }
+        ip++;
+        STORE_FRAME();
         concatenate();
-      } else if (IS_NUMBER(stackPeek(&vm.stack, 0)) &&
-                 IS_NUMBER(stackPeek(&vm.stack, 1))) {
-        double b = AS_NUMBER(stackPop(&vm.stack));
-        double a = AS_NUMBER(stackPop(&vm.stack));
-        stackPush(&vm.stack, NUMBER_VAL(a + b));
-      } else {
-        runtimeError("Operands must be two numbers or two strings.");
-        return INTERPRET_RUNTIME_ERROR;
+        stackTop = vm.stack.top;
+        DISPATCH();
       }
-      break;
-    }
-    case OP_SUBTRACT:
-      BINARY_OP(NUMBER_VAL, -);
-      break;
-    case OP_MULTIPLY:
-      BINARY_OP(NUMBER_VAL, *);
-      break;
-    case OP_DIVIDE:
-      BINARY_OP(NUMBER_VAL, /);
-      break;
-    case OP_NOT:
-      stackPush(&vm.stack, BOOL_VAL(isFalsey(stackPop(&vm.stack))));
-      break;
-    case OP_EQUAL: {
-      Value b = stackPop(&vm.stack);
-      Value a = stackPop(&vm.stack);
-      stackPush(&vm.stack, BOOL_VAL(valuesEqual(a, b)));
-      break;
-    }
-    case OP_GET_LOCAL_LONG:
-      isLong = true; // don't break, fall through
-    case OP_GET_LOCAL: {
-      uint32_t slot = READ_SLOT(isLong);
-      stackPush(&vm.stack, vm.stack.items[frame->base + slot]);
-      break;
-    }
-    case OP_SET_LOCAL_LONG:
-      isLong = true; // don't break, fall through
-    case OP_SET_LOCAL: {
-      uint32_t slot = READ_SLOT(isLong);
-      vm.stack.items[frame->base + slot] = stackPeek(&vm.stack, 0);
-      break;
-    }
-    case OP_NEGATE:
-      if (!IS_NUMBER(stackPeek(&vm.stack, 0))) {
-        runtimeError("Operand must be a number.");
-        return INTERPRET_RUNTIME_ERROR;
+      CASE(OP_SUBTRACT) : {
+        BINARY_OP(NUMBER_VAL, -);
+        DISPATCH();
       }
-      stackPush(&vm.stack, NUMBER_VAL(-AS_NUMBER(stackPop(&vm.stack))));
-      break;
-    case OP_PRINT: {
-      printValue(stackPop(&vm.stack));
-      printf("\n");
-      break;
-    }
-    case OP_POP:
-      stackPop(&vm.stack);
-      break;
-    case OP_SET_UPVALUE_LONG:
-      isLong = true; // don't break, fall through
-    case OP_SET_UPVALUE: {
-      uint32_t slot = READ_SLOT(isLong);
-      int pos = frame->closure->upvalues[slot]->location;
-      if (pos == -1) {
-        frame->closure->upvalues[slot]->closed = stackPeek(&vm.stack, 0);
-      } else {
-        vm.stack.items[pos] = stackPeek(&vm.stack, 0);
+      CASE(OP_MULTIPLY) : {
+        BINARY_OP(NUMBER_VAL, *);
+        DISPATCH();
       }
-      break;
-    }
-    case OP_DEFINE_GLOBAL_LONG:
-      isLong = true; // don't break, fall through
-    case OP_DEFINE_GLOBAL: {
-      ObjString *name = READ_STRING(isLong);
-      tableSet(&vm.globals, name, stackPeek(&vm.stack, 0));
-      stackPop(&vm.stack);
-      break;
-    }
-    case OP_GET_UPVALUE_LONG:
-      isLong = true; // don't break, fall through
-    case OP_GET_UPVALUE: {
-      uint32_t slot = READ_SLOT(isLong);
-      int pos = frame->closure->upvalues[slot]->location;
-      if (pos == -1) {
-        stackPush(&vm.stack, frame->closure->upvalues[slot]->closed);
-      } else {
-        stackPush(&vm.stack, vm.stack.items[pos]);
+      CASE(OP_DIVIDE) : {
+        BINARY_OP(NUMBER_VAL, /);
+        DISPATCH();
       }
-      break;
-    }
-    case OP_GET_GLOBAL_LONG:
-      isLong = true; // don't break, fall through
-    case OP_GET_GLOBAL: {
-      ObjString *name = READ_STRING(isLong);
-      Value value;
-      if (!tableGet(&vm.globals, name, &value)) {
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
+      CASE(OP_NOT) : {
+        PEEK(0) = BOOL_VAL(isFalsey(PEEK(0)));
+        DISPATCH();
       }
-      stackPush(&vm.stack, value);
-      break;
-    }
-    case OP_SET_GLOBAL_LONG:
-      isLong = true; // don't break, fall through
-    case OP_SET_GLOBAL: {
-      ObjString *name = READ_STRING(isLong);
-      if (tableSet(&vm.globals, name, stackPeek(&vm.stack, 0))) {
-        tableDelete(&vm.globals, name);
-        runtimeError("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
+      CASE(OP_EQUAL) : {
+        // comparing a rope flattens it, which may collect
+        STORE_FRAME();
+        bool equal = valuesEqual(PEEK(1), PEEK(0));
+        stackTop--;
+        PEEK(0) = BOOL_VAL(equal);
+        DISPATCH();
       }
-      break;
-    }
-    case OP_INHERIT: {
-      Value superclass = stackPeek(&vm.stack, 1);
-      if (!IS_CLASS(superclass)) {
-        runtimeError("Superclass must be a class.");
-        return INTERPRET_RUNTIME_ERROR;
+      LONG_VARIANTS(OP_GET_LOCAL, {
+        uint32_t slot = READ_SLOT(isLong);
+        PUSH(slots[slot]);
+        DISPATCH();
+      })
+      LONG_VARIANTS(OP_SET_LOCAL, {
+        uint32_t slot = READ_SLOT(isLong);
+        slots[slot] = PEEK(0);
+        DISPATCH();
+      })
+      CASE(OP_SET_LOCAL_POP) : {
+        uint8_t slot = READ_BYTE();
+        slots[slot] = POP();
+        DISPATCH();
       }
-      ObjClass *subclass = AS_CLASS(stackPeek(&vm.stack, 0));
-      tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-      stackPop(&vm.stack); // Subclass.
-      break;
-    }
-    case OP_GET_SUPER_LONG:
-      isLong = true;
-    case OP_GET_SUPER: {
-      ObjString *name = READ_STRING(isLong);
-      ObjClass *superclass = AS_CLASS(stackPop(&vm.stack));
-
-      if (!bindMethod(superclass, name)) {
-        return INTERPRET_RUNTIME_ERROR;
+      CASE(OP_NEGATE) : {
+        if (!IS_NUMBER(PEEK(0))) {
+          RUNTIME_ERROR("Operand must be a number.");
+        }
+        PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+        DISPATCH();
       }
-      break;
-    }
-    case OP_SUPER_INVOKE_LONG:
-      isLong = true;
-    case OP_SUPER_INVOKE: {
-      ObjString *method = READ_STRING(isLong);
-      int argCount = READ_BYTE();
-      ObjClass *superclass = AS_CLASS(stackPop(&vm.stack));
-      if (!invokeFromClass(superclass, method, argCount)) {
-        return INTERPRET_RUNTIME_ERROR;
+      CASE(OP_PRINT) : {
+        printValue(POP());
+        printf("\n");
+        DISPATCH();
       }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
-    }
-    case OP_JUMP: {
-      uint16_t offset = READ_SHORT();
-      frame->ip += offset;
-      break;
-    }
-    case OP_JUMP_IF_FALSE: {
-      uint16_t offset = READ_SHORT();
-      if (isFalsey(stackPeek(&vm.stack, 0))) {
-        frame->ip += offset;
+      CASE(OP_POP) : {
+        stackTop--;
+        DISPATCH();
       }
-      break;
-    }
-    case OP_LOOP: {
-      uint16_t offset = READ_SHORT();
-      frame->ip -= offset;
-      break;
-    }
-    case OP_GREATER:
-      BINARY_OP(BOOL_VAL, >);
-      break;
-    case OP_LESS:
-      BINARY_OP(BOOL_VAL, <);
-      break;
-    case OP_CALL: {
-      int argCount = READ_BYTE();
-      if (!callValue(stackPeek(&vm.stack, argCount), argCount)) {
-        return INTERPRET_RUNTIME_ERROR;
+      LONG_VARIANTS(OP_SET_UPVALUE, {
+        uint32_t slot = READ_SLOT(isLong);
+        ObjUpvalue *upvalue = frame->closure->upvalues[slot];
+        *upvalue->location = PEEK(0);
+        writeBarrier((Obj *)upvalue);
+        DISPATCH();
+      })
+      LONG_VARIANTS(OP_DEFINE_GLOBAL, {
+        uint32_t slot = READ_SLOT(isLong);
+        vm.globalValues.values[slot] = POP();
+        DISPATCH();
+      })
+      LONG_VARIANTS(OP_GET_UPVALUE, {
+        uint32_t slot = READ_SLOT(isLong);
+        PUSH(*frame->closure->upvalues[slot]->location);
+        DISPATCH();
+      })
+      LONG_VARIANTS(OP_GET_GLOBAL, {
+        uint32_t slot = READ_SLOT(isLong);
+        Value value = vm.globalValues.values[slot];
+        if (IS_UNDEFINED(value)) {
+          RUNTIME_ERROR("Undefined variable '%s'.",
+                        AS_STRING(vm.globalNames.values[slot])->chars);
+        }
+        PUSH(value);
+        DISPATCH();
+      })
+      LONG_VARIANTS(OP_SET_GLOBAL, {
+        uint32_t slot = READ_SLOT(isLong);
+        if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+          RUNTIME_ERROR("Undefined variable '%s'.",
+                        AS_STRING(vm.globalNames.values[slot])->chars);
+        }
+        vm.globalValues.values[slot] = PEEK(0);
+        DISPATCH();
+      })
+      CASE(OP_SET_GLOBAL_POP) : {
+        uint8_t slot = READ_BYTE();
+        if (IS_UNDEFINED(vm.globalValues.values[slot])) {
+          RUNTIME_ERROR("Undefined variable '%s'.",
+                        AS_STRING(vm.globalNames.values[slot])->chars);
+        }
+        vm.globalValues.values[slot] = POP();
+        DISPATCH();
       }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
-    }
-    case OP_GET_PROPERTY_LONG:
-      isLong = true; // don't break, fall through
-    case OP_GET_PROPERTY: {
-      if (!IS_INSTANCE(stackPeek(&vm.stack, 0))) {
-        runtimeError("Only instances have properties.");
-        return INTERPRET_RUNTIME_ERROR;
+      CASE(OP_INHERIT) : {
+        Value superclass = PEEK(1);
+        if (!IS_CLASS(superclass)) {
+          RUNTIME_ERROR("Superclass must be a class.");
+        }
+        ObjClass *subclass = AS_CLASS(PEEK(0));
+        STORE_FRAME();
+        tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
+        writeBarrier((Obj *)subclass);
+        if (subclass->hasCachedMethods) {
+          vm.methodEpoch++;
+        }
+        stackTop--; // Subclass.
+        DISPATCH();
+      }
+      LONG_VARIANTS(OP_GET_SUPER, {
+        InlineCache *cache = READ_CACHE(isLong);
+        ObjClass *superclass = AS_CLASS(POP());
+        STORE_FRAME();
+        CacheEntry *entry = findCacheEntry(cache, superclass->rootShape);
+        ObjClosure *method;
+        if (entry != NULL) {
+          method = entry->method;
+        } else {
+          method = findMethod(superclass, cache->name);
+          if (method == NULL) {
+            return INTERPRET_RUNTIME_ERROR;
+          }
+          cacheMethod(cache, superclass->rootShape, superclass, method);
+        }
+        bindMethod(method);
+        stackTop = vm.stack.top;
+        DISPATCH();
+      })
+      LONG_VARIANTS(OP_SUPER_INVOKE, {
+        InlineCache *cache = READ_CACHE(isLong);
+        int argCount = READ_BYTE();
+        ObjClass *superclass = AS_CLASS(POP());
+        STORE_FRAME();
+        CacheEntry *entry = findCacheEntry(cache, superclass->rootShape);
+        ObjClosure *method;
+        if (entry != NULL) {
+          method = entry->method;
+        } else {
+          method = findMethod(superclass, cache->name);
+          if (method == NULL) {
+            return INTERPRET_RUNTIME_ERROR;
+          }
+          cacheMethod(cache, superclass->rootShape, superclass, method);
+        }
+        if (!call(method, argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        DISPATCH();
+      })
+      CASE(OP_JUMP) : {
+        uint16_t offset = READ_SHORT();
+        ip += offset;
+        DISPATCH();
       }
-      ObjInstance *instance = AS_INSTANCE(stackPeek(&vm.stack, 0));
-      ObjString *name = READ_STRING(isLong);
-      Value value;
-      if (tableGet(&instance->fields, name, &value)) {
-        stackPop(&vm.stack); // Instance.
-        stackPush(&vm.stack, value);
-        break;
+      CASE(OP_JUMP_IF_FALSE) : {
+        uint16_t offset = READ_SHORT();
+        if (isFalsey(PEEK(0))) {
+          ip += offset;
+        }
+        DISPATCH();
       }
-      if (!bindMethod(instance->klass, name)) {
-        return INTERPRET_RUNTIME_ERROR;
+      CASE(OP_POP_JUMP_IF_FALSE) : {
+        uint16_t offset = READ_SHORT();
+        if (isFalsey(POP())) {
+          ip += offset;
+        }
+        DISPATCH();
       }
-      break;
-    }
-    case OP_SET_PROPERTY_LONG:
-      isLong = true; // don't break, fall through
-    case OP_SET_PROPERTY: {
-      if (!IS_INSTANCE(stackPeek(&vm.stack, 1))) {
-        runtimeError("Only instances have fields.");
-        return INTERPRET_RUNTIME_ERROR;
+      CASE(OP_POP_JUMP_IF_TRUE) : {
+        uint16_t offset = READ_SHORT();
+        if (!isFalsey(POP())) {
+          ip += offset;
+        }
+        DISPATCH();
       }
-      ObjInstance *instance = AS_INSTANCE(stackPeek(&vm.stack, 1));
-      tableSet(&instance->fields, READ_STRING(isLong), stackPeek(&vm.stack, 0));
-      Value value = stackPop(&vm.stack);
-      stackPop(&vm.stack);
-      stackPush(&vm.stack, value);
-      break;
-    }
-    case OP_INVOKE_LONG:
-      isLong = true; // don't break, fall through
-    case OP_INVOKE: {
-      ObjString *method = READ_STRING(isLong);
-      int argCount = READ_BYTE();
-      if (!invoke(method, argCount)) {
-        return INTERPRET_RUNTIME_ERROR;
+      CASE(OP_LOOP) : {
+        uint16_t offset = READ_SHORT();
+        ip -= offset;
+        if (vm.compactPending) {
+          STORE_FRAME();
+          compactHeap();
+        }
+        DISPATCH();
       }
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
-    }
-    case OP_METHOD_LONG:
-      isLong = true; // don't break, fall through
-    case OP_METHOD:
-      defineMethod(READ_STRING(isLong));
-      break;
-    case OP_CLASS_LONG:
-      isLong = true; // don't break, fall through
-    case OP_CLASS:
-      stackPush(&vm.stack, OBJ_VAL(newClass(READ_STRING(isLong))));
-      break;
-    case OP_CLOSE_UPVALUE:
-      closeUpvalues(vm.stack.top - 1);
-      stackPop(&vm.stack);
-      break;
-    case OP_RETURN: {
-      Value result = stackPop(&vm.stack);
-      closeUpvalues(frame->base);
-      vm.frameCount--;
-      if (vm.frameCount == 0) {
-        stackPop(&vm.stack);
-        return INTERPRET_OK;
+      CASE(OP_GREATER) : {
+        BINARY_OP(BOOL_VAL, >);
+        DISPATCH();
+      }
+      CASE(OP_LESS) : {
+        BINARY_OP(BOOL_VAL, <);
+        DISPATCH();
       }
+      CASE(OP_CALL) : {
+        int argCount = READ_BYTE();
+        STORE_FRAME();
+        // loops and calls are the safe points where objects may move
+        if (vm.compactPending) {
+          compactHeap();
+        }
+        if (!callValue(PEEK(argCount), argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        DISPATCH();
+      }
+      CASE(OP_GET_LOCAL_PROPERTY) : {
+        uint8_t slot = READ_BYTE();
+        PUSH(slots[slot]);
+        // ip is now at the cache operand, go on as OP_GET_PROPERTY
+      }
+      LONG_VARIANTS(OP_GET_PROPERTY, {
+        if (!IS_INSTANCE(PEEK(0))) {
+          RUNTIME_ERROR("Only instances have properties.");
+        }
+        ObjInstance *instance = AS_INSTANCE(PEEK(0));
+        InlineCache *cache = READ_CACHE(isLong);
+        CacheEntry *entry = findCacheEntry(cache, instance->shape);
+        if (entry != NULL) {
+          if (entry->method == NULL) {
+            PEEK(0) = instance->fields[entry->slot]; // Instance.
+          } else {
+            STORE_FRAME();
+            bindMethod(entry->method);
+            stackTop = vm.stack.top;
+          }
+          DISPATCH();
+        }
 
-      // put the stack pointer back to before the function call
-      vm.stack.top = frame->base;
-      stackPush(&vm.stack, result);
-      frame = &vm.frames[vm.frameCount - 1];
-      break;
-    }
-    case OP_NIL:
-      stackPush(&vm.stack, NIL_VAL);
-      break;
-    case OP_TRUE:
-      stackPush(&vm.stack, BOOL_VAL(true));
-      break;
-    case OP_FALSE:
-      stackPush(&vm.stack, BOOL_VAL(false));
-      break;
-    case OP_CLOSURE_LONG:
-      isLong = true; // don't break, fall through
-    case OP_CLOSURE: {
-      ObjFunction *function = AS_FUNCTION(READ_CONSTANT(isLong));
-      ObjClosure *closure = newClosure(function);
-      int count = closure->upvalueCount;
-      for (int i = 0; i < closure->upvalueCount; i++) {
-        uint8_t isLocal = READ_BYTE();
-        uint32_t index = READ_SLOT(true);
-        if (isLocal) {
-          int pos = frame->base + index;
-          closure->upvalues[i] = captureUpvalue(pos);
+        ObjString *name = cache->name;
+        if (instance->shape != NULL) {
+          int slot = shapeFindSlot(instance->shape, name);
+          if (slot != -1) {
+            updateCache(cache, instance->shape, NULL, slot, NULL);
+            PEEK(0) = instance->fields[slot]; // Instance.
+            DISPATCH();
+          }
+        } else {
+          Value value;
+          if (tableGet(&instance->dictionary, name, &value)) {
+            PEEK(0) = value; // Instance.
+            DISPATCH();
+          }
+        }
+        STORE_FRAME();
+        ObjClosure *method = findMethod(instance->klass, name);
+        if (method == NULL) {
+          return INTERPRET_RUNTIME_ERROR;
+        }
+        if (instance->shape != NULL) {
+          cacheMethod(cache, instance->shape, instance->klass, method);
+        }
+        bindMethod(method);
+        stackTop = vm.stack.top;
+        DISPATCH();
+      })
+      LONG_VARIANTS(OP_SET_PROPERTY, {
+        if (!IS_INSTANCE(PEEK(1))) {
+          RUNTIME_ERROR("Only instances have fields.");
+        }
+        ObjInstance *instance = AS_INSTANCE(PEEK(1));
+        InlineCache *cache = READ_CACHE(isLong);
+        Value value = PEEK(0);
+        CacheEntry *entry = findCacheEntry(cache, instance->shape);
+        if (entry != NULL && entry->slot < (uint32_t)instance->fieldCapacity) {
+          instance->fields[entry->slot] = value;
+          if (entry->transition != NULL) {
+            instance->shape = entry->transition;
+          }
+          writeBarrier((Obj *)instance);
         } else {
-          ObjUpvalue *upValue = frame->closure->upvalues[index];
-          closure->upvalues[i] = upValue;
+          ObjShape *shape = instance->shape;
+          STORE_FRAME();
+          instanceSetField(instance, cache->name, value);
+          if (entry == NULL && shape != NULL && instance->shape != NULL) {
+            if (instance->shape == shape) {
+              updateCache(cache, shape, NULL, shapeFindSlot(shape, cache->name),
+                          NULL);
+            } else {
+              updateCache(cache, shape, instance->shape,
+                          instance->shape->fieldCount - 1, NULL);
+            }
+          }
+        }
+        stackTop--;
+        PEEK(0) = value;
+        DISPATCH();
+      })
+      LONG_VARIANTS(OP_INVOKE, {
+        InlineCache *cache = READ_CACHE(isLong);
+        int argCount = READ_BYTE();
+        STORE_FRAME();
+        Value receiver = PEEK(argCount);
+        CacheEntry *entry = NULL;
+        if (IS_INSTANCE(receiver)) {
+          entry = findCacheEntry(cache, AS_INSTANCE(receiver)->shape);
+        }
+        if (entry != NULL) {
+          if (!call(entry->method, argCount)) {
+            return INTERPRET_RUNTIME_ERROR;
+          }
+        } else if (!invoke(cache, argCount)) {
+          return INTERPRET_RUNTIME_ERROR;
         }
+        LOAD_FRAME();
+        DISPATCH();
+      })
+      LONG_VARIANTS(OP_METHOD, {
+        ObjString *name = READ_STRING(isLong);
+        STORE_FRAME();
+        defineMethod(name);
+        stackTop = vm.stack.top;
+        DISPATCH();
+      })
+      LONG_VARIANTS(OP_CLASS, {
+        ObjString *name = READ_STRING(isLong);
+        STORE_FRAME();
+        PUSH(OBJ_VAL(newClass(name)));
+        DISPATCH();
+      })
+      CASE(OP_CLOSE_UPVALUE) : {
+        closeUpvalues(stackTop - 1);
+        stackTop--;
+        DISPATCH();
       }
-      stackPush(&vm.stack, OBJ_VAL(closure));
-      break;
-    }
+      CASE(OP_RETURN) : {
+        Value result = POP();
+        closeUpvalues(slots);
+        vm.frameCount--;
+        if (vm.frameCount == 0) {
+          vm.stack.top = slots;
+          return INTERPRET_OK;
+        }
+
+        // put the stack pointer back to before the function call
+        stackTop = slots;
+        PUSH(result);
+        frame = &vm.frames[vm.frameCount - 1];
+        ip = frame->ip;
+        slots = frame->slots;
+        DISPATCH();
+      }
+      CASE(OP_NIL) : {
+        PUSH(NIL_VAL);
+        DISPATCH();
+      }
+      CASE(OP_TRUE) : {
+        PUSH(BOOL_VAL(true));
+        DISPATCH();
+      }
+      CASE(OP_FALSE) : {
+        PUSH(BOOL_VAL(false));
+        DISPATCH();
+      }
+      LONG_VARIANTS(OP_CLOSURE, {
+        ObjFunction *function = AS_FUNCTION(READ_CONSTANT(isLong));
+        STORE_FRAME();
+        ObjClosure *closure = newClosure(function);
+        // keep the closure reachable while its upvalues are allocated
+        PUSH(OBJ_VAL(closure));
+        vm.stack.top = stackTop;
+        for (int i = 0; i < closure->upvalueCount; i++) {
+          uint8_t isLocal = READ_BYTE();
+          uint32_t index = READ_LONG();
+          if (isLocal) {
+            closure->upvalues[i] = captureUpvalue(slots + index);
+            // capturing allocates, the closure may be old by now
+            writeBarrier((Obj *)closure);
+          } else {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+          }
+        }
+        DISPATCH();
+      })
+#ifndef COMPUTED_GOTO
     default: {
       printf("Unknown opcode %d\n", instruction);
       return INTERPRET_RUNTIME_ERROR;
     }
+#endif
     }
   }
 }
 
+#undef LONG_VARIANTS
+#undef DISPATCH
+#undef CASE
+#undef SWITCH
 #undef READ_SHORT
+#undef READ_LONG
 #undef READ_SLOT
 #undef READ_CONSTANT
 #undef READ_STRING
+#undef READ_CACHE
 #undef BINARY_OP
+#undef DEOPTIMIZE_ADD
 #undef READ_BYTE
+#undef PEEK
+#undef POP
+#undef PUSH
+#undef RUNTIME_ERROR
+#undef LOAD_FRAME
+#undef STORE_FRAME
 
 InterpretResult interpret(const char *source) {
   ObjFunction *function = compile(source);
@@ -609,4 +1044,75 @@ InterpretResult interpret(const char *source) {
   InterpretResult result = run();
   resetStack(&vm.stack);
   return result;
-}
\ No newline at end of file
+}
+
+static uint64_t cacheHits = 0;
+static uint64_t cacheMisses = 0;
+
+static void printFunctionCacheStats(void *object) {
+  if (((Obj *)object)->type != OBJ_FUNCTION) {
+    return;
+  }
+  ObjFunction *function = (ObjFunction *)object;
+  Chunk *chunk = &function->chunk;
+  printCacheStats(chunk, function->name != NULL ? function->name->chars
+                                                : "<script>");
+  for (uint32_t i = 0; i < chunk->cacheCount; i++) {
+    cacheHits += chunk->caches[i].hits;
+    cacheMisses += chunk->caches[i].misses;
+  }
+}
+
+void printInlineCacheStats() {
+  // the background sweeper may still own some of the functions
+  finishSweeping();
+  fprintf(stderr, "== inline caches ==\n");
+  cacheHits = 0;
+  cacheMisses = 0;
+  heapEachObject(printFunctionCacheStats);
+  fprintf(stderr, "total hits %llu misses %llu\n",
+          (unsigned long long)cacheHits, (unsigned long long)cacheMisses);
+}
+
+void printGCPauses() {
+  double average =
+      vm.pauseCount > 0 ? (double)vm.pauseTotal / vm.pauseCount : 0;
+  fprintf(stderr, "gc pauses %d total %.3f ms max %.3f ms avg %.3f ms\n",
+          vm.pauseCount, vm.pauseTotal / 1e6, vm.pauseMax / 1e6,
+          average / 1e6);
+}
+
+void printGCStats() {
+  flushGCStats();
+  GCStats *stats = &vm.gcStats;
+  fprintf(stderr, "== gc stats ==\n");
+  fprintf(stderr, "cycles minor %d full %d\n", stats->minorCycles,
+          stats->fullCycles);
+  fprintf(stderr, "mark %.3f ms sweep %.3f ms\n", stats->markTime / 1e6,
+          stats->sweepTime / 1e6);
+  fprintf(stderr, "freed %zu bytes, heap %zu bytes, gray max %d\n",
+          stats->bytesFreed, vm.bytesAllocated, stats->grayMax);
+  fprintf(stderr, "freed objects");
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    fprintf(stderr, " %s %llu", objTypeNames[i],
+            (unsigned long long)stats->freed[i]);
+  }
+  fprintf(stderr, "\n");
+}
+
+void printGCCycle(GCCycle *cycle) {
+  fprintf(stderr,
+          "{\"type\":\"%s\",\"start\":%.3f,\"end\":%.3f,\"mark\":%.3f,"
+          "\"sweep\":%.3f,\"pauses\":%d,\"pauseMax\":%.3f,"
+          "\"bytesBefore\":%zu,\"bytesAfter\":%zu,\"bytesFreed\":%zu,"
+          "\"grayMax\":%d,\"freed\":{",
+          cycle->full ? "full" : "minor", cycle->start / 1e6,
+          cycle->end / 1e6, cycle->markTime / 1e6, cycle->sweepTime / 1e6,
+          cycle->pauses, cycle->pauseMax / 1e6, cycle->bytesBefore,
+          cycle->bytesAfter, cycle->bytesFreed, cycle->grayMax);
+  for (int i = 0; i < OBJ_TYPE_COUNT; i++) {
+    fprintf(stderr, "%s\"%s\":%u", i > 0 ? "," : "", objTypeNames[i],
+            cycle->freed[i]);
+  }
+  fprintf(stderr, "}}\n");
+}